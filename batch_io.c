@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "batch_io.h"
+
+#define SUCCESS 0
+#define FAILURE -1
+
+/*
+ * int
+ * batch_init
+ *
+ * Allocates a batch of `size` datagrams of at most `buf_len` bytes each.
+ */
+int batch_init(Batch *b, int size, int buf_len) {
+  b->size = size;
+  b->count = 0;
+  b->buf_len = buf_len;
+  b->bufs = malloc((size_t)size * buf_len);
+  b->msgs = calloc(size, sizeof(struct mmsghdr));
+  b->iovs = calloc(size, sizeof(struct iovec));
+  b->addrs = calloc(size, sizeof(struct sockaddr_in));
+
+  if(b->bufs == NULL || b->msgs == NULL ||
+     b->iovs == NULL || b->addrs == NULL) {
+    perror("batch_init: malloc");
+    return FAILURE;
+  }
+
+  /* Point every header at its own buffer and address */
+  for(int i=0; i<size; i++) {
+    b->iovs[i].iov_base = b->bufs + (size_t)i * buf_len;
+    b->iovs[i].iov_len = buf_len;
+    b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+
+  return SUCCESS;
+}
+
+/*
+ * int
+ * batch_recv
+ *
+ * Drains up to `size` datagrams that are already queued on `fd`, without
+ * blocking. Returns the number of datagrams received (possibly 0), or -1
+ * on error.
+ */
+int batch_recv(Batch *b, int fd) {
+  int n;
+
+  /* The kernel overwrites the lengths, so reset them on every call */
+  for(int i=0; i<b->size; i++) {
+    b->iovs[i].iov_base = b->bufs + (size_t)i * b->buf_len;
+    b->iovs[i].iov_len = b->buf_len;
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  }
+
+  do {
+    n = recvmmsg(fd, b->msgs, b->size, MSG_DONTWAIT, NULL);
+  } while(n < 0 && errno == EINTR);
+
+  if(n < 0) {
+    b->count = 0;
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return FAILURE;
+  }
+
+  b->count = n;
+  return n;
+}
+
+/*
+ * Returns the payload of the i-th datagram in the batch.
+ */
+char *batch_data(Batch *b, int i) {
+  return b->iovs[i].iov_base;
+}
+
+/*
+ * Returns the length of the i-th datagram received in the batch.
+ */
+int batch_length(Batch *b, int i) {
+  return b->msgs[i].msg_len;
+}
+
+/*
+ * int
+ * batch_send
+ *
+ * Copies `buf` into the batch, to be sent to `to` on the next flush. If
+ * the batch is already full it is flushed to `fd` first.
+ */
+int batch_send(Batch *b, int fd, const struct sockaddr_in *to,
+               const void *buf, int len) {
+  int status = SUCCESS;
+
+  if(len > b->buf_len) {
+    errno = EMSGSIZE;
+    return FAILURE;
+  }
+
+  if(b->count == b->size)
+    status = batch_flush(b, fd);
+
+  int i = b->count++;
+  b->iovs[i].iov_base = b->bufs + (size_t)i * b->buf_len;
+  memcpy(b->iovs[i].iov_base, buf, len);
+  b->iovs[i].iov_len = len;
+  b->addrs[i] = *to;
+  b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+  return status;
+}
+
+/*
+ * int
+ * batch_send_ref
+ *
+ * Same as batch_send(), but `buf` is referenced instead of copied, so it
+ * must not change until the batch is flushed.
+ */
+int batch_send_ref(Batch *b, int fd, const struct sockaddr_in *to,
+                   const void *buf, int len) {
+  int status = SUCCESS;
+
+  if(b->count == b->size)
+    status = batch_flush(b, fd);
+
+  int i = b->count++;
+  b->iovs[i].iov_base = (void *)buf;
+  b->iovs[i].iov_len = len;
+  b->addrs[i] = *to;
+  b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+  return status;
+}
+
+/*
+ * int
+ * batch_flush
+ *
+ * Sends every queued datagram on `fd` with as few sendmmsg() calls as
+ * possible, and empties the batch. A datagram that fails to send is
+ * skipped, so that one bad destination doesn't hold up the rest; -1 is
+ * returned (with errno set) if that happened.
+ */
+int batch_flush(Batch *b, int fd) {
+  int sent = 0, status = SUCCESS, saved_errno = 0;
+
+  while(sent < b->count) {
+    int n = sendmmsg(fd, b->msgs + sent, b->count - sent, 0);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      saved_errno = errno;
+      status = FAILURE;
+      n = 1;
+    }
+    sent += n;
+  }
+
+  b->count = 0;
+  if(status == FAILURE)
+    errno = saved_errno;
+  return status;
+}
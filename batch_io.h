@@ -0,0 +1,44 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Number of datagrams moved per recvmmsg()/sendmmsg() call. Can be
+ * overridden at build time, e.g. `make BATCH_SIZE=64`.
+ */
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 32
+#endif
+
+/*
+ * Struct Batch, a set of `size` datagram buffers of `buf_len` bytes each,
+ * along with the headers recvmmsg() and sendmmsg() need. A batch is used
+ * either for receiving or for queueing packets to be sent, not both.
+ * Queued packets either get copied into the batch's own buffers, or are
+ * referenced in place (batch_send_ref), in which case the caller has to
+ * keep them intact until the next flush.
+ */
+struct Batch {
+  int size;
+  int count;
+  int buf_len;
+  char *bufs;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct sockaddr_in *addrs;
+};
+typedef struct Batch Batch;
+
+int batch_flush(Batch *b, int fd);
+int batch_init(Batch *b, int size, int buf_len);
+int batch_recv(Batch *b, int fd);
+int batch_send(Batch *b, int fd, const struct sockaddr_in *to,
+               const void *buf, int len);
+int batch_send_ref(Batch *b, int fd, const struct sockaddr_in *to,
+                   const void *buf, int len);
+char *batch_data(Batch *b, int i);
+int batch_length(Batch *b, int i);
+
+#endif
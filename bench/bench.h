@@ -0,0 +1,28 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Shared by the benchmarks: each one is a single program that includes
+ * router.c, with its main() renamed, and works on its state directly.
+ */
+#define main router_main
+#include "../router.c"
+#undef main
+
+double elapsed_us(const struct timespec *start);
+
+/*
+ * double
+ * elapsed_us
+ *
+ * Returns the number of microseconds since `start`.
+ */
+double elapsed_us(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e6 +
+         (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+#endif
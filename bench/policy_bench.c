@@ -0,0 +1,154 @@
+/*
+ * Benchmark of the routing policy, on random rules added directly to the
+ * policy of router.c (see bench.h). Random paths are evaluated against the
+ * compiled rules, then by going through every rule in order, and both are
+ * timed; the two have to agree on every path. Run by `make bench`.
+ */
+#include "bench.h"
+
+void reset_policy(void);
+void add_random_rules(int num_rules, int num_ids);
+void add_rule(char buff[80]);
+int evaluate_naively(int origin, const Path *path);
+void bench_policy(const char *name, int num_ids, int num_rules,
+                  int num_evaluations);
+
+#define NUM_PATHS 1000
+
+/*
+ * void
+ * reset_policy
+ *
+ * Removes every rule of the policy.
+ */
+void reset_policy(void) {
+  for(int i=0; i<policy.num_rules; i++)
+    free(policy.rules[i].via);
+  policy.num_rules = 0;
+  policy.is_dirty = TRUE;
+}
+
+/*
+ * void
+ * add_rule
+ *
+ * Adds the rule in `buff`, as add_policy_rule() takes it, to the end of the
+ * policy, without applying it. Exits if it isn't valid.
+ */
+void add_rule(char buff[80]) {
+  Policy_rule rule;
+  int via[MAX_PATH];
+
+  if(parse_policy_rule(buff, &rule, via) != SUCCESS)
+    exit(1);
+  append_policy_rule(&rule);
+}
+
+/*
+ * void
+ * add_random_rules
+ *
+ * Adds `num_rules` random rules naming routers below `num_ids`: rejections
+ * of the paths to an origin through some routers, preferences for the
+ * paths to an origin of some lengths, and one in fifty for any origin.
+ */
+void add_random_rules(int num_rules, int num_ids) {
+  char buff[80];
+
+  for(int i=0; i<num_rules; i++) {
+    if(i % 50 == 49)
+      snprintf(buff, sizeof(buff), "A reject via %d", rand() % num_ids);
+    else if(i % 3 == 0)
+      snprintf(buff, sizeof(buff), "A reject origin %d via %d %d",
+               rand() % num_ids, rand() % num_ids, rand() % num_ids);
+    else if(i % 3 == 1)
+      snprintf(buff, sizeof(buff), "A pref %d origin %d length 2 %d",
+               rand() % MAX_LOCAL_PREF, rand() % num_ids, 2 + rand() % 6);
+    else
+      snprintf(buff, sizeof(buff), "A prefer origin %d via %d",
+               rand() % num_ids, rand() % num_ids);
+    add_rule(buff);
+  }
+}
+
+/*
+ * int
+ * evaluate_naively
+ *
+ * Returns what evaluate_policy() should for `path` to `origin`, found by
+ * going through every rule in the order they were added.
+ */
+int evaluate_naively(int origin, const Path *path) {
+  for(int i=0; i<policy.num_rules; i++) {
+    const Policy_rule *rule = &policy.rules[i];
+    if((rule->origin == UNSET || rule->origin == origin) &&
+       policy_rule_matches(rule, path) == TRUE)
+      return (rule->action == POLICY_REJECT) ? UNSET : rule->local_pref;
+  }
+  return DEFAULT_LOCAL_PREF;
+}
+
+/*
+ * void
+ * bench_policy
+ *
+ * Times `num_evaluations` evaluations of random paths between routers
+ * below `num_ids`, against `num_rules` random rules, with the compiled
+ * rules and naively, and exits if the two disagree on any path.
+ */
+void bench_policy(const char *name, int num_ids, int num_rules,
+                  int num_evaluations) {
+  Path *paths[NUM_PATHS];
+  int origins[NUM_PATHS], num_rejected = 0;
+  double compiled, naive;
+  volatile int pref;
+  struct timespec start;
+
+  reset_policy();
+  add_random_rules(num_rules, num_ids);
+  for(int i=0; i<NUM_PATHS; i++) {
+    int hops[MAX_PATH], length = 2 + rand() % 6;
+    for(int j=0; j<length; j++)
+      hops[j] = rand() % num_ids;
+    paths[i] = new_path(hops, length);
+    origins[i] = hops[length - 1];
+  }
+
+  for(int i=0; i<NUM_PATHS; i++) {
+    int expected = evaluate_naively(origins[i], paths[i]);
+    pref = evaluate_policy(origins[i], paths[i]);
+    if(pref != expected) {
+      printf("path %d: compiled policy gives %d, rules in order %d\n",
+             i, pref, expected);
+      exit(1);
+    }
+    if(pref == UNSET)
+      num_rejected++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(int i=0; i<num_evaluations; i++)
+    pref = evaluate_policy(origins[i % NUM_PATHS], paths[i % NUM_PATHS]);
+  compiled = elapsed_us(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(int i=0; i<num_evaluations / 100; i++)
+    pref = evaluate_naively(origins[i % NUM_PATHS], paths[i % NUM_PATHS]);
+  naive = elapsed_us(&start) * 100;
+
+  printf("%-24s %5d rules  %3d%% rejected  compiled %7.3f us  "
+         "in order %8.3f us  %6.1fx\n",
+         name, policy.num_rules, num_rejected * 100 / NUM_PATHS,
+         compiled / num_evaluations, naive / num_evaluations,
+         naive / compiled);
+}
+
+int main(void) {
+  srand(1);
+
+  bench_policy("2000 routers", 2000, 5000, 2000000);
+  bench_policy("200 routers", 200, 5000, 2000000);
+  bench_policy("200 routers", 200, 500, 2000000);
+
+  return 0;
+}
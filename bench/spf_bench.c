@@ -0,0 +1,343 @@
+/*
+ * Benchmark of the shortest path computations, on topologies built
+ * directly in the link state database of router.c (see bench.h). After
+ * every random link change, the tree is repaired incrementally, then
+ * recomputed from scratch, and both are timed; the repaired tree has to
+ * have the same distances as the recomputed one, and the same equal cost
+ * next hops, and both have to have the next hops their branches start
+ * with. The two breadth-first engines are compared the same way on small
+ * unit cost topologies. Run by `make bench`.
+ */
+#include "bench.h"
+
+void reset_topology(void);
+void build_random(int num_nodes, int degree, int is_weighted);
+void build_fat_tree(int k);
+void build_dense(int num_nodes, double density);
+void random_link_change(void);
+void check_tree(const int *dist);
+void check_ecmp(const int *ecmp);
+void check_next_hops(void);
+void bench_incremental_spf(const char *name, int num_changes);
+void bench_bfs_engines(const char *name, int repetitions);
+
+/*
+ * void
+ * reset_topology
+ *
+ * Empties the topology, and forgets the last shortest path tree.
+ */
+void reset_topology(void) {
+  for(int i=0; i<router.num_nodes; i++)
+    free(router.nodes[i].links);
+  free(router.nodes);
+  free(router.node_index);
+  memset(&router, 0, sizeof(router));
+  spf.is_valid = FALSE;
+  spf.num_nodes = 0;
+  spf.num_changes = 0;
+  bitmap.is_stale = TRUE;
+}
+
+/*
+ * void
+ * build_random
+ *
+ * Builds a connected random topology of `num_nodes` routers, with an
+ * average of `degree` links each. Links cost 1 to 10 if `is_weighted`,
+ * 1 otherwise.
+ */
+void build_random(int num_nodes, int degree, int is_weighted) {
+  reset_topology();
+  for(int i=0; i<num_nodes; i++)
+    add_node(i);
+
+  /* A random spanning tree keeps it connected */
+  for(int i=1; i<num_nodes; i++)
+    set_link(i, rand() % i, 0, is_weighted ? 1 + rand() % 10 : 1);
+  for(int i=0; i<num_nodes * (degree - 2) / 2; i++) {
+    int a = rand() % num_nodes, b = rand() % num_nodes;
+    if(a != b)
+      set_link(a, b, 0, is_weighted ? 1 + rand() % 10 : 1);
+  }
+}
+
+/*
+ * void
+ * build_fat_tree
+ *
+ * Builds a k-ary fat-tree: (k/2)^2 core routers, and k pods of k/2
+ * aggregation and k/2 edge routers. Every link costs 1.
+ */
+void build_fat_tree(int k) {
+  int num_core = (k / 2) * (k / 2), num_aggregation = k * k / 2;
+
+  reset_topology();
+  for(int i=0; i<num_core + 2 * num_aggregation; i++)
+    add_node(i);
+
+  for(int pod=0; pod<k; pod++) {
+    for(int a=0; a<k/2; a++) {
+      int aggregation = num_core + pod * (k / 2) + a;
+      for(int c=0; c<k/2; c++)
+        set_link(aggregation, a * (k / 2) + c, 0, 1);
+      for(int e=0; e<k/2; e++)
+        set_link(aggregation, num_core + num_aggregation + pod * (k / 2) + e,
+                 0, 1);
+    }
+  }
+}
+
+/*
+ * void
+ * build_dense
+ *
+ * Builds a random topology of `num_nodes` routers, where any two are
+ * linked with probability `density`. Every link costs 1.
+ */
+void build_dense(int num_nodes, double density) {
+  reset_topology();
+  for(int i=0; i<num_nodes; i++)
+    add_node(i);
+
+  for(int i=0; i<num_nodes; i++)
+    for(int j=i+1; j<num_nodes; j++)
+      if(rand() < density * RAND_MAX)
+        set_link(i, j, 0, 1);
+}
+
+/*
+ * void
+ * random_link_change
+ *
+ * Removes a link, changes the cost of one, or adds one, at random.
+ */
+void random_link_change(void) {
+  int a = rand() % router.num_nodes;
+  Node *node = &router.nodes[a];
+
+  if(node->num_links > 1 && rand() % 2 == 0) {
+    remove_link(a, node->links[rand() % node->num_links].to);
+  }
+  else if(node->num_links > 0 && rand() % 3 == 0) {
+    Link *link = &node->links[rand() % node->num_links];
+    set_link(a, link->to, 0, (link->cost == 1) ? 5 : 1);
+  }
+  else {
+    int b = rand() % router.num_nodes;
+    if(b != a)
+      set_link(a, b, 0, 1 + rand() % 3);
+  }
+}
+
+/*
+ * void
+ * check_tree
+ *
+ * Compares the distances of the tree that was just recomputed from scratch
+ * to `dist`, those of the repaired one, and exits if any differs.
+ */
+void check_tree(const int *dist) {
+  for(int i=0; i<router.num_nodes; i++) {
+    if(dist[i] != spf.dist[i]) {
+      printf("node %d: repaired distance %d, recomputed %d\n",
+             i, dist[i], spf.dist[i]);
+      exit(1);
+    }
+  }
+}
+
+/*
+ * void
+ * check_ecmp
+ *
+ * Compares the equal cost next hops of the tree that was just recomputed
+ * to `ecmp`, those of the repaired one, and exits if they aren't the same
+ * for any node. They are compared as sets, and not at all for nodes that
+ * have more than MAX_ECMP_PATHS of them: which ones are kept then depends
+ * on the order they were found in.
+ */
+void check_ecmp(const int *ecmp) {
+  for(int i=0; i<router.num_nodes; i++) {
+    const int *a = ecmp + (size_t)i * MAX_ECMP_PATHS;
+    const int *b = spf.ecmp + (size_t)i * MAX_ECMP_PATHS;
+    int num_a = 0, num_b = 0;
+
+    while(num_a < MAX_ECMP_PATHS && a[num_a] != UNSET)
+      num_a++;
+    while(num_b < MAX_ECMP_PATHS && b[num_b] != UNSET)
+      num_b++;
+    if(num_a == MAX_ECMP_PATHS && num_b == MAX_ECMP_PATHS)
+      continue;
+
+    int is_same = (num_a == num_b);
+    for(int k=0; k<num_a && is_same == TRUE; k++) {
+      is_same = FALSE;
+      for(int m=0; m<num_b; m++)
+        if(a[k] == b[m])
+          is_same = TRUE;
+    }
+    if(is_same == FALSE) {
+      printf("node %d: %d repaired equal cost next hops, %d recomputed\n",
+             i, num_a, num_b);
+      exit(1);
+    }
+  }
+}
+
+/*
+ * void
+ * check_next_hops
+ *
+ * Checks that the next hop resolved for every node is the first node of
+ * its branch of the tree, found by walking the previous hops back up to
+ * the root, and exits otherwise. Unreachable nodes, and the root, have
+ * none.
+ */
+void check_next_hops(void) {
+  for(int i=0; i<router.num_nodes; i++) {
+    int next_hop = UNSET;
+    if(i != spf.root && spf.dist[i] != MAX_INT) {
+      next_hop = i;
+      while(spf.previous[next_hop] != spf.root)
+        next_hop = spf.previous[next_hop];
+    }
+    if(spf.next_hop[i] != next_hop || route_next_hop(i) != next_hop) {
+      printf("node %d: next hop %d, its branch starts with %d\n",
+             i, spf.next_hop[i], next_hop);
+      exit(1);
+    }
+  }
+}
+
+/*
+ * void
+ * bench_incremental_spf
+ *
+ * Times `num_changes` random link changes on the current topology, each
+ * handled by repairing the tree, then by recomputing it.
+ */
+void bench_incremental_spf(const char *name, int num_changes) {
+  int *dist = malloc(router.num_nodes * sizeof(int));
+  int *ecmp = malloc((size_t)router.num_nodes * MAX_ECMP_PATHS * sizeof(int));
+  double incremental = 0, full = 0;
+  struct timespec start;
+
+  if(dist == NULL || ecmp == NULL) {
+    perror("bench_incremental_spf: malloc");
+    exit(1);
+  }
+
+  router.id = 0;
+  router.index = 0;
+  spf.is_valid = FALSE;
+  dijkstra(router.id);
+
+  for(int i=0; i<num_changes; i++) {
+    random_link_change();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    dijkstra(router.id);
+    incremental += elapsed_us(&start);
+    memcpy(dist, spf.dist, router.num_nodes * sizeof(int));
+    memcpy(ecmp, spf.ecmp,
+           (size_t)router.num_nodes * MAX_ECMP_PATHS * sizeof(int));
+    check_next_hops();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    spf.is_valid = FALSE;
+    dijkstra(router.id);
+    full += elapsed_us(&start);
+    check_tree(dist);
+    check_ecmp(ecmp);
+    check_next_hops();
+  }
+
+  printf("%-24s %6d nodes  full %9.1f us  incremental %8.1f us  %6.1fx\n",
+         name, router.num_nodes, full / num_changes,
+         incremental / num_changes, full / incremental);
+  free(dist);
+  free(ecmp);
+}
+
+/*
+ * void
+ * bench_bfs_engines
+ *
+ * Times spf_bfs() against spf_bitset() from node 0 of the current
+ * topology, and checks that they find the same distances, and previous
+ * hops that are on a shortest path.
+ */
+void bench_bfs_engines(const char *name, int repetitions) {
+  Spf_engine engines[2] = { spf_bfs, spf_bitset };
+  int *dist = malloc(router.num_nodes * sizeof(int));
+  double elapsed[2] = { 0, 0 };
+  struct timespec start;
+
+  if(dist == NULL) {
+    perror("bench_bfs_engines: malloc");
+    exit(1);
+  }
+
+  grow_spf_state();
+  spf.uniform_cost = 1;
+  for(int e=0; e<2; e++) {
+    for(int r=0; r<repetitions; r++) {
+      for(int i=0; i<router.num_nodes; i++) {
+        spf.dist[i] = MAX_INT;
+        spf.previous[i] = UNSET;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      engines[e](0);
+      elapsed[e] += elapsed_us(&start);
+    }
+    if(e == 0)
+      memcpy(dist, spf.dist, router.num_nodes * sizeof(int));
+  }
+
+  for(int i=0; i<router.num_nodes; i++) {
+    int previous = spf.previous[i];
+    if(dist[i] != spf.dist[i]) {
+      printf("node %d: breadth-first distance %d, bitset %d\n",
+             i, dist[i], spf.dist[i]);
+      exit(1);
+    }
+    if(previous != UNSET && (spf.dist[previous] + 1 != spf.dist[i] ||
+                             find_link(previous, i) == NULL)) {
+      printf("node %d: previous hop %d is not on a shortest path\n",
+             i, previous);
+      exit(1);
+    }
+  }
+
+  printf("%-24s %6d nodes  bfs %8.2f us  bitset %8.2f us  %6.1fx\n",
+         name, router.num_nodes, elapsed[0] / repetitions,
+         elapsed[1] / repetitions, elapsed[0] / elapsed[1]);
+  free(dist);
+}
+
+int main(void) {
+  srand(1);
+
+  build_random(2000, 6, TRUE);
+  bench_incremental_spf("random, weighted", 2000);
+  build_random(20000, 6, TRUE);
+  bench_incremental_spf("random, weighted", 200);
+  build_random(20000, 6, FALSE);
+  bench_incremental_spf("random, unit cost", 200);
+  build_fat_tree(16);
+  bench_incremental_spf("fat-tree k=16", 2000);
+  build_fat_tree(32);
+  bench_incremental_spf("fat-tree k=32", 500);
+
+  build_dense(64, 0.3);
+  bench_bfs_engines("dense, p=0.3", 2000);
+  build_dense(200, 0.1);
+  bench_bfs_engines("dense, p=0.1", 2000);
+  build_dense(500, 0.05);
+  bench_bfs_engines("dense, p=0.05", 2000);
+  build_fat_tree(16);
+  bench_bfs_engines("fat-tree k=16", 2000);
+
+  return 0;
+}
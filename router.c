@@ -1,29 +1,177 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/time.h>
+#include <errno.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "batch_io.h"
+#include "wire.h"
 
 #define NUM_THREADS 5
 #define SUCCESS 0
 #define FAILURE -1
 
-#define MAX_INT 35
+#define MAX_INT INT_MAX
+
+/* Largest router ID accepted, it bounds the size of the ID-to-index map */
+#define MAX_ROUTER_ID 65535
+
+/* Longest path that can be stored or advertised */
+#define MAX_PATH 64
+
+/* Cost of a link when none is configured, and the largest one allowed */
+#define DEFAULT_LINK_COST 1
+#define MAX_LINK_COST 65535
+
+/*
+ * Number of link changes that are repaired incrementally in the shortest
+ * path tree; past that, it is recomputed from scratch.
+ */
+#define MAX_INCREMENTAL_CHANGES 8
+
+/*
+ * Most equal cost next hops kept per destination; flows are spread over
+ * them (see select_path()).
+ */
+#define MAX_ECMP_PATHS 8
+
+/*
+ * Throttling of the route computations, in milliseconds. After a quiet
+ * period, routes are computed SPF_INITIAL_DELAY after the first change.
+ * While changes keep coming, each computation waits for the hold time
+ * since the previous one, which starts at SPF_HOLD_TIME and doubles up to
+ * SPF_MAX_HOLD_TIME. It is quiet once no computation ran for that long.
+ */
+#define SPF_INITIAL_DELAY 50
+#define SPF_HOLD_TIME 200
+#define SPF_MAX_HOLD_TIME 5000
+
+/*
+ * Local preference of a path vector route that no policy rule sets, and
+ * the largest one a rule can set, which is what preferring a path gives.
+ */
+#define DEFAULT_LOCAL_PREF 100
+#define MAX_LOCAL_PREF 65535
+
+/* Actions of the policy rules */
+#define POLICY_REJECT 1
+#define POLICY_LOCAL_PREF 2
+
+/* Largest topology for which the adjacency bitmap is kept */
+#define MAX_BITMAP_NODES 512
 
 #define TIMEOUT 1
 
 #define HOST "localhost"
 
-#define NEIGHBOR_LAG 3
+/*
+ * Neighbors are sent a hello every DEFAULT_HELLO_INTERVAL milliseconds,
+ * and declared down after DEFAULT_DETECT_MULTIPLIER of their hellos went
+ * missing, unless configured otherwise. Each hello carries the interval
+ * and multiplier of its sender, which is what it is held to.
+ */
+#define DEFAULT_HELLO_INTERVAL 1000
+#define DEFAULT_DETECT_MULTIPLIER 3
+#define MAX_HELLO_INTERVAL 60000
+#define MAX_DETECT_MULTIPLIER 255
+
+/*
+ * Largest factor the hello and path vector intervals can back off by,
+ * while nothing changes (see Adaptive_timers).
+ */
+#define MAX_BACKOFF_FACTOR 64
+
+/* Periods (in seconds) of the timers driven by the event loop */
+#define FLOOD_INTERVAL 1
+
+/*
+ * Link state advertisements are flooded when they change, and refreshed
+ * every LSA_REFRESH_INTERVAL seconds regardless. One that hasn't been
+ * refreshed for LSA_MAX_AGE seconds is dropped from the database.
+ */
+#define LSA_REFRESH_INTERVAL 30
+#define LSA_MAX_AGE 95
+
+/*
+ * The timer wheel goes forward TIMER_TICK milliseconds at a time, which
+ * is also the resolution of the timers. It has two levels of
+ * TIMER_WHEEL_SIZE slots: one tick each, and TIMER_WHEEL_SIZE ticks each.
+ * Together they span the longest timeout.
+ */
+#define TIMER_TICK 10
+#define TIMER_WHEEL_SIZE 256
+
+/* Large enough to hold any of the packet types */
+#define RECV_BUFFER_SIZE 2048
+
+/*
+ * Most routes and withdrawals carried by a path vector update. Updates are
+ * also kept within RECV_BUFFER_SIZE bytes, PV_UPDATE_OVERHEAD of which are
+ * left for everything but the routes and withdrawals.
+ */
+#define MAX_PV_ROUTES 32
+#define MAX_PV_WITHDRAWN 512
+#define PV_UPDATE_OVERHEAD 32
+
+/*
+ * Most neighbors carried in a link state packet: as many as fit in a
+ * receive buffer with every field at its longest encoding. LSA_OVERHEAD
+ * bytes go to the header, relayed_by, the sender's ID and port (3 bytes
+ * each), the sequence number (5) and the number of neighbors (2), and
+ * LSA_NEIGHBOR_SIZE to the ID and cost of each neighbor (3 bytes each).
+ */
+#define LSA_OVERHEAD (WIRE_HEADER_SIZE + 4 + 3 + 5 + 3 + 2)
+#define LSA_NEIGHBOR_SIZE (3 + 3)
+#define MAX_LSA_NEIGHBORS \
+  ((RECV_BUFFER_SIZE - LSA_OVERHEAD) / LSA_NEIGHBOR_SIZE)
+
+/* Flags of path vector updates */
+#define PV_REFRESH 1
+
+/*
+ * Largest batch of commands accepted at once, from the control socket or
+ * a configuration file, and longest command in it (as on the console).
+ */
+#define MAX_BATCH_SIZE (1 << 20)
+#define MAX_COMMAND 80
+
+/* Maximum number of events handled per epoll_wait() */
+#define MAX_EVENTS 32
+
+/*
+ * Number of control packets the forwarding thread can hand over before
+ * the control thread has to catch up. Must be a power of two.
+ */
+#define CONTROL_QUEUE_SIZE 256
+
+/*
+ * Most link state and path vector packets the control thread processes
+ * before letting hellos and timers have their turn.
+ */
+#define CONTROL_BUDGET 32
 
 #define UNSET -1
 
-/* Different packet types */
+/* Different kinds of timers */
+#define NEIGHBOR_TIMER 1
+#define LSA_TIMER 2
+#define SPF_TIMER 3
+
+/* Different packet types, as carried in the wire header */
 #define PING 1
 #define MSG 2
 #define PV 3
@@ -33,116 +181,836 @@
 #define FALSE 0
 
 /*
- * Struct Neighbor, stores the ID, port #, and time 
- * that it was last heard from.
+ * Struct Neighbor, stores the ID, port #, cost of the link to it,
+ * and time that it was last heard from (in milliseconds, on the local
+ * monotonic clock). `expiry_timer` goes off when it has missed too many
+ * hellos, and it is down until the next one; `hold_time` is how long that
+ * is, as its last hello said. The other fields keep track of what it was
+ * sent, for the keepalives (see ping_neighbors()).
  */
 struct Neighbor {
   char key[10];
+  int announced_interval; /* in the last hello it was sent */
+  int cost;
+  int expiry_timer;
+  int hellos_skipped;
+  int hold_time;
   int id;
   int is_paired;
+  int is_up;
   int port;
   long int last_seen;
+  long int last_sent; /* last link state or path vector packet */
 };
 typedef struct Neighbor Neighbor;
 
 /*
- * Struct Path_vector contains the destination
- * and path of the vector
+ * Struct Path_vector contains the destination and path of the vector:
+ * the `length` routers it goes through, the last being the destination.
  */
 struct Path_vector {
   int dest;
-  int path[20];
+  int length;
+  int path[MAX_PATH];
 };
 
 /*
- * Packet used to ping neighbors
+ * The packets, as decoded from the wire format (see the encode_*_packet()
+ * and decode_*_packet() functions). All the fields are in host order.
+ */
+
+/*
+ * Packet used to ping neighbors, with the interval (in milliseconds) the
+ * sender sends them at, and how many can go missing before it is down.
  */
 struct Ping_packet {
   int sender_LS_port;
   int sender_PV_port;
   int sender_id;
-  long int timestamp;
+  int interval;
+  int detect_multiplier;
 };
 typedef struct Ping_packet Ping_packet;
 
 /*
- * Packet used to send messages to routers (via the console)
+ * Packet used to send messages to routers (via the console). A message
+ * that is being repaired around a failure is tunneled to `tunnel` first,
+ * which is UNSET otherwise. Messages of the same `flow` to a destination
+ * take the same path.
  */
 struct Msg_packet {
   int dest;
+  int tunnel;
+  int flow;
 };
 typedef struct Msg_packet Msg_packet;
 
 /*
- * Packet that contains the path vector, along with key
+ * Packet that contains path vectors, along with key: an update, with the
+ * destinations the sender no longer offers a path to, and the paths it
+ * offers that are new or changed since its last update. If `flags` has
+ * PV_REFRESH, the sender asks for all of our paths.
  */
 struct Pv_packet {
-  int key[10];
+  char key[10];
   int sender_PV_port;
-  struct Path_vector pv;
+  int flags;
+  int num_withdrawn;
+  int num_routes;
+  int withdrawn[MAX_PV_WITHDRAWN];
+  struct Path_vector routes[MAX_PV_ROUTES];
 };
 typedef struct Pv_packet Pv_packet;
 
 /*
- * Data packet used for communicating link-state information
+ * Struct Lsa_neighbor, an adjacency listed in a link state packet.
+ */
+struct Lsa_neighbor {
+  int id;
+  int cost;
+};
+typedef struct Lsa_neighbor Lsa_neighbor;
+
+/*
+ * Data packet used for communicating link-state information: the live
+ * adjacencies of router `sender_id`. A higher `sequence` supersedes the
+ * advertisements it sent before. `relayed_by` is the ID of the router the
+ * packet was last received from, so that it isn't sent back there. It is
+ * encoded first, with a fixed width, so that the packet can be flooded on
+ * as it was received (`buff`, `cc` bytes) with just that field rewritten.
  * */
 struct Link_state_packet {
-  Neighbor neighbors[20];
+  Lsa_neighbor neighbors[MAX_LSA_NEIGHBORS];
   int num_neighbors;
-  int seen_by[20];
+  unsigned int sequence;
+  int relayed_by;
   int sender_LS_port; 
   int sender_id;
-  long int timestamp;
+  char *buff;
+  int cc;
 };
 typedef struct Link_state_packet Link_state_packet;
 
 /*
-* All the information relevant to the router.
+ * Struct Encoded_packet, a packet in the wire format, ready to be sent.
+ */
+struct Encoded_packet {
+  int length;
+  unsigned char data[RECV_BUFFER_SIZE];
+};
+typedef struct Encoded_packet Encoded_packet;
+
+/*
+ * Struct Link, an entry in the adjacency list of a node. Stores the index
+ * of the node at the other end, the cost of going there, and the time the
+ * link was last heard from (see monotonic_time()).
+ */
+struct Link {
+  int to;
+  int cost;
+  long int last_seen;
+};
+typedef struct Link Link;
+
+/*
+ * Struct Path, a route that doesn't come from the shortest path tree: a
+ * preferred path, or one learned from a path vector. `hops` holds the IDs
+ * of the routers after this one, the last being the destination. Paths
+ * are interned (see new_path()): equal paths are one object, shared by
+ * its `refs` holders, so they compare by pointer. `bloom` has the bit of
+ * every router on the path set (see id_bloom()), which answers most
+ * membership tests without going through the hops.
+ */
+struct Path {
+  struct Path *next; /* in its bucket of the path table */
+  unsigned int hash;
+  int refs;
+  uint64_t bloom;
+  int length;
+  int hops[];
+};
+typedef struct Path Path;
+
+/*
+ * Struct Path_table, the interned paths, chained by hash into
+ * `num_buckets` buckets, a power of two. It doubles once it holds more
+ * paths than it has buckets.
+ */
+struct Path_table {
+  Path **buckets;
+  int num_buckets;
+  int num_paths;
+};
+typedef struct Path_table Path_table;
+
+/*
+ * Struct Policy_rule, a rule of the routing policy. It matches the paths
+ * to `origin` (to any destination if UNSET) with a length in
+ * [min_length, max_length] that, if any routers are listed in `via`, go
+ * through one of them on the way. `via_bloom` is the bloom filter of
+ * those (see id_bloom()). A matching rule rejects the path, or gives it
+ * the local preference `local_pref`.
+ */
+struct Policy_rule {
+  int origin;
+  int min_length;
+  int max_length;
+  int action;
+  int local_pref;
+  int *via;
+  int num_via;
+  uint64_t via_bloom;
+};
+typedef struct Policy_rule Policy_rule;
+
+/*
+ * Struct Policy, the rules in the order they were added, the first one
+ * that matches a path deciding, and their compiled form: `origins` lists
+ * the origins that have rules of their own, sorted, and those of
+ * origins[k] are by_origin[starts[k]] up to by_origin[starts[k + 1]],
+ * while the rules for any origin are in `any`, all in order. A path is
+ * only matched against the rules that can apply to it. The rules are
+ * compiled again lazily, after a change marked them dirty.
+ */
+struct Policy {
+  Policy_rule *rules;
+  int *origins;
+  int *starts;
+  int *by_origin;
+  int *any;
+  int num_rules;
+  int num_origins;
+  int num_any;
+  int max_rules;
+  int max_compiled;
+  int is_dirty;
+};
+typedef struct Policy Policy;
+
+/*
+ * Struct Lsa, the last link state advertisement installed for a router:
+ * its sequence number and the adjacencies it lists (`to` is a node index,
+ * `last_seen` is when the advertisement was received or originated).
+ */
+struct Lsa {
+  unsigned int sequence;
+  int num_links;
+  Link links[];
+};
+typedef struct Lsa Lsa;
+
+/*
+ * Struct Node, a router of the network: its adjacency list, its entry in
+ * the link state database, and the policies that apply to it. A link is
+ * stored in the adjacency lists of both its ends, and is there as long as
+ * the advertisements of both ends agree on it (see sync_link()). The
+ * route to a node is its branch of the shortest path tree, unless `path`
+ * overrides it.
+ */
+struct Node {
+  int id;
+  Link *links;
+  int num_links;
+  int max_links;
+  Lsa *lsa;
+  int lsa_timer; /* goes off when `lsa` gets too old */
+  Path *path;
+  int is_preferred;
+  int is_rejected;
+  int uses_path_vector;
+};
+typedef struct Node Node;
+
+/*
+ * Struct Adj_rib_out, the paths a peering session was sent, indexed like
+ * the nodes of the topology (NULL where none was), so that only the
+ * changes go out. `version` is spf_throttle.num_runs as of the last
+ * update: nothing changed since if it still is. The session `is_synced`
+ * once we heard from the peer; until then we ask it for a refresh.
+ */
+struct Adj_rib_out {
+  Path **paths;
+  int is_synced;
+  int max_paths;
+  unsigned long version;
+};
+typedef struct Adj_rib_out Adj_rib_out;
+
+/*
+ * Struct Adj_rib_in, the paths a peering session offered, indexed like the
+ * nodes of the topology (NULL where it offered none). They are kept until
+ * withdrawn or until the session is lost, so that another one can take
+ * over from the path in use without waiting for the peers (see
+ * select_pv_path()). `prefs` holds the local preference the policy gives
+ * each path, UNSET if it rejects it.
+ */
+struct Adj_rib_in {
+  Path **paths;
+  int *prefs;
+  int max_paths;
+};
+typedef struct Adj_rib_in Adj_rib_in;
+
+/*
+ * An SPF engine computes, from the node with index `start`, the distance
+ * to and the previous hop towards every node (both by index) into
+ * spf.dist and spf.previous. Unreachable nodes are left at MAX_INT/UNSET.
+ */
+typedef void (*Spf_engine)(int start);
+
+/*
+ * Struct Adjacency_bitmap, a packed copy of the adjacency lists for small
+ * topologies: bit j of row i is set if there is a link from node i to node
+ * j. Rows are `words` 64-bit words long, and there are words * 64 of them.
+ * Only the existence of the links is mirrored here, their costs and
+ * liveness stay in the adjacency lists. `visited`, `frontier` and `next`
+ * are one row each, used as scratch space by spf_bitset().
+ */
+struct Adjacency_bitmap {
+  uint64_t *rows;
+  uint64_t *visited;
+  uint64_t *frontier;
+  uint64_t *next;
+  int is_stale;
+  int words;
+};
+typedef struct Adjacency_bitmap Adjacency_bitmap;
+
+/*
+ * Struct Link_change, a link whose cost or existence changed since the
+ * last shortest path computation. Both directions may have changed.
+ */
+struct Link_change {
+  int a;
+  int b;
+};
+typedef struct Link_change Link_change;
+
+/*
+ * Struct Spf_state, the results of the last shortest path computation and
+ * the scratch space the engines use. The arrays hold `max_nodes` entries
+ * and are reused across runs; `num_nodes` of them hold results.
+ *
+ * While `is_valid`, dist/previous form the shortest path tree rooted at
+ * `root` for the topology minus the link changes listed in `changes`, so
+ * the tree can be repaired rather than recomputed. The tree is the routing
+ * table: `next_hop` holds, for every node, the child of the root its
+ * branch starts with, and full paths are only walked out of `previous`
+ * when they are printed or advertised.
+ */
+struct Spf_state {
+  int *dist;
+  int *previous;
+  int *next_hop;
+  int *next_hop_mark; /* == next_hop_generation if next_hop is resolved */
+  int *ecmp;  /* MAX_ECMP_PATHS equal cost next hops per node, UNSET padded */
+  int *order; /* nodes by increasing distance, while resolving `ecmp` */
+  int *heap;      /* binary min-heap of node indices, keyed on heap_dist */
+  int *heap_pos;  /* position of each node in the heap, UNSET if not in it */
+  int *heap_dist; /* dist, unless the heap is borrowed (see spf_distances()) */
+  int *subtree;      /* nodes of the subtree being repaired */
+  int *subtree_mark; /* == generation if the node is in `subtree` */
+  int *touch_mark;   /* == generation if the node is in `touched` */
+  int *touched;      /* nodes whose path changed in the last repair */
+  int *affected;      /* nodes whose `ecmp` is resolved again */
+  int *affected_mark; /* == generation if the node is in `affected` */
+  int *source_mark;   /* == generation if the node is in `order` */
+  int generation;
+  int heap_size;
+  int next_hop_generation;
+  int is_valid;
+  int max_ecmp;
+  int max_nodes;
+  int num_changes;
+  int num_affected;
+  int num_nodes;
+  int num_touched;
+  int root;
+  int uniform_cost; /* cost of every link, when spf_bfs() is selected */
+  Link_change changes[MAX_INCREMENTAL_CHANGES];
+};
+typedef struct Spf_state Spf_state;
+
+/*
+ * Struct Flood_edge, a link of the topology, as a candidate for the
+ * flooding tree. `a` and `b` are node indices, `a` having the lower ID,
+ * and `cost` is the larger of the costs of the two directions.
+ */
+struct Flood_edge {
+  int a;
+  int b;
+  int cost;
+};
+typedef struct Flood_edge Flood_edge;
+
+/*
+ * Struct Flood_tree, the topology link state advertisements are relayed
+ * over: a minimum spanning tree of the link state database. Ties are
+ * broken on router IDs, so every router with the same database computes
+ * the same tree, and relaying only over its links still reaches everyone.
+ * `is_tree_neighbor` tells, by node index, which links of this router are
+ * in the tree; `parent` is the union-find forest used while computing it.
+ * The tree is recomputed lazily, after something marked it dirty.
+ */
+struct Flood_tree {
+  Flood_edge *edges;
+  int *is_tree_neighbor;
+  int *parent;
+  int is_dirty;
+  int is_enabled;
+  int max_edges;
+  int max_nodes;
+  unsigned long floods_avoided; /* relays a full flood would have sent */
+};
+typedef struct Flood_tree Flood_tree;
+
+/*
+* All the information relevant to the router. The topology is a growable
+* set of nodes, and `node_index` maps a router ID to its index in `nodes`.
 */ 
 struct Router {
-	int routing_table[20][20];
-  Neighbor neighbors[20];
+  Neighbor *neighbors;
+  Node *nodes;
+  Adj_rib_in *rib_in; /* parallel to `neighbors` */
+  Adj_rib_out *rib_out; /* parallel to `neighbors` */
+  int *node_index;
   int border_router_neighbors[5];
+  int detect_multiplier;
+  int hello_interval; /* in milliseconds */
   int id;
+  int index;
   int is_border_router;
-  int is_preferred[20];
-  int is_rejected[20];
+  int max_neighbors;
+  int max_node_id;
+  int max_nodes;
   int myLSport; // terrible naming, but sticking with the specs
   int myPVport;
   int num_border_neighbors;
   int num_neighbors;
-  long int network_matrix[20][20];
-  long int uses_path_vector[20];
+  int num_nodes;
+  unsigned int lsa_sequence; /* of the last advertisement this router sent */
+  uint64_t rejected_bloom; /* id_bloom() of every rejected router */
 };
 typedef struct Router Router;
 
+/*
+ * Struct Adaptive_timers, the intervals hellos and path vector updates are
+ * currently sent at, in milliseconds, and the timerfds sending them. With
+ * backoff enabled (-a), an interval doubles every time it goes by without
+ * a change, up to `max_factor` times the configured one, and snaps back to
+ * that on the first change. Link state and path vector packets then double
+ * as keepalives too. `last_change` is the time of the last change, and
+ * `seen_changes` the value of fib.num_changes at that time.
+ */
+struct Adaptive_timers {
+  int flood_fd;
+  int flood_interval;
+  int hello_fd;
+  int hello_interval;
+  int max_factor;
+  long int last_change;
+  unsigned long seen_changes;
+  unsigned long hellos_saved;
+};
+typedef struct Adaptive_timers Adaptive_timers;
+
+/*
+ * Struct Event_source, a file descriptor registered with the event loop
+ * and the function that is called whenever it becomes readable.
+ */
+struct Event_source {
+  int fd;
+  void (*handle)(int fd);
+};
+typedef struct Event_source Event_source;
+
+/*
+ * Struct Control_socket, the Unix domain socket at `path` that batches of
+ * commands are sent over, if one was asked for (-c), and its connections,
+ * indexed by file descriptor. `clients[fd]` holds what connection `fd` sent
+ * so far: its batch runs once the client shuts down its side (see
+ * run_batch()).
+ */
+struct Control_client {
+  char *buff;
+  int used;
+  int max;
+};
+typedef struct Control_client Control_client;
+
+struct Control_socket {
+  Control_client *clients;
+  const char *path;
+  int max_clients;
+};
+typedef struct Control_socket Control_socket;
+
+/*
+ * Struct Timer, an entry of the timer wheel: what to do when it goes off
+ * (`kind`, applied to the neighbor or node `index`), and when (in ticks).
+ * While it is scheduled, it is in the list of slot `slot`, linked by
+ * index; the slots of the second level come after those of the first.
+ */
+struct Timer {
+  long int expires;
+  int index;
+  int kind;
+  int next;
+  int prev;
+  int slot;
+};
+typedef struct Timer Timer;
+
+/*
+ * Struct Timer_wheel, the timers of the control thread, hashed on their
+ * expiry time: into the first level if they are due within
+ * TIMER_WHEEL_SIZE ticks, the second one otherwise. `current` is the tick
+ * up to which they have been expired; every time it enters a new slot of
+ * the second level, the timers in it move down to the first. Timers are
+ * handed out by index and never freed: there is one per neighbor, and one
+ * per node of the topology. The timerfd `fd` goes off once, at tick
+ * `armed`, when the wheel next has to be moved forward.
+ */
+struct Timer_wheel {
+  Timer *timers;
+  int slots[2 * TIMER_WHEEL_SIZE];
+  int max_timers;
+  int num_timers;
+  long int current;
+  int fd;
+  long int armed;
+};
+typedef struct Timer_wheel Timer_wheel;
+
+/*
+ * Struct Fib_entry, how messages to a destination are forwarded: the ID of
+ * the next hop towards it, the port that next hop is reached on, and the
+ * ID of the router they are tunneled to on the way, if any. The backup
+ * fields say the same for when the next hop fails (see repair_fib()).
+ * If there are several equal cost next hops, all of them (`next_hop`
+ * included) are in `paths`, and each flow picks one.
+ */
+struct Fib_entry {
+  int next_hop;
+  int port;
+  int tunnel;
+  int backup_next_hop;
+  int backup_port;
+  int backup_tunnel;
+  int num_paths;
+  int path_next_hops[MAX_ECMP_PATHS];
+  int path_ports[MAX_ECMP_PATHS];
+};
+typedef struct Fib_entry Fib_entry;
+
+/*
+ * Struct Fib_index, the map from destination ID to entry of the forwarding
+ * tables built for `num_nodes` nodes, UNSET where there is none. A table
+ * has an entry per node, in the order of the nodes, which only changes
+ * when nodes are added: until then, the tables share the map, and it is
+ * freed along with the last of its `refs` holders.
+ */
+struct Fib_index {
+  int refs;
+  int num_nodes;
+  int max_node_id;
+  int slots[];
+};
+typedef struct Fib_index Fib_index;
+
+/*
+ * Struct Fib_table, a forwarding table: an entry per destination, found
+ * through `index`. A table is never modified once published: the control
+ * thread publishes a new one instead, and frees the old one once the
+ * forwarding thread has gone through a quiescent state (see
+ * retire_fib_table()).
+ */
+struct Fib_table {
+  struct Fib_table *next_retired;
+  unsigned long retired_epoch;
+  Fib_index *index;
+  int num_entries;
+  Fib_entry entries[];
+};
+typedef struct Fib_table Fib_table;
+
+/*
+ * Struct Fib, the forwarding state kept by the control thread: the table
+ * that is currently published, the retired ones that may still be in use,
+ * the index of the last table built, and the port of every neighbor (by
+ * node index), used while building a table. A new table is built lazily,
+ * only after something marked it dirty.
+ */
+struct Fib {
+  Fib_table *table;
+  Fib_table *retired;
+  Fib_index *index;
+  int *port;
+  int is_dirty;
+  int max_nodes;
+  unsigned long num_changes; /* things that marked it dirty, ever */
+};
+typedef struct Fib Fib;
+
+/*
+ * Struct Spf_throttle, schedules the route computations (see
+ * schedule_spf()). A computation is pending on `timer` while
+ * `is_scheduled`; the changes made in the meantime are taken along with
+ * it, and each batch of them counts as a suppressed run. `seen_changes`
+ * is fib.num_changes as of the last batch looked at.
+ */
+struct Spf_throttle {
+  int timer;
+  int hold;
+  int is_scheduled;
+  long int last_run;
+  unsigned long seen_changes;
+  unsigned long num_runs;
+  unsigned long num_suppressed;
+};
+typedef struct Spf_throttle Spf_throttle;
+
+/*
+ * Struct Lfa_state, the loop-free alternates: for every node, `backup` is
+ * the neighbor (by index) to send messages for it to when its next hop
+ * fails, UNSET if there is none, and `tunnel` the node to tunnel them to
+ * from there, for a remote LFA. Per link of this router, `pq_node` is the
+ * remote LFA that protects it, and `pq_via` the link it is reached over.
+ * `dist` holds the rows of distances they are computed from (see
+ * update_lfas()), for a topology of `num_nodes` nodes. Those only change
+ * with the topology, which marks them dirty.
+ */
+struct Lfa_state {
+  int *backup;
+  int *tunnel;
+  int *pq_node;
+  int *pq_via;
+  int *dist;
+  int is_dirty;
+  int max_dist;
+  int max_links;
+  int max_nodes;
+  int num_nodes;
+};
+typedef struct Lfa_state Lfa_state;
+
+/*
+ * Struct Control_queue, the packets the forwarding thread hands over to
+ * the control thread. It is a single-producer, single-consumer ring of
+ * CONTROL_QUEUE_SIZE receive buffers: the forwarding thread only moves
+ * `head`, the control thread only moves `tail`, and `event_fd` wakes the
+ * control thread up. Packets that don't fit are dropped and counted.
+ * Hellos have a queue of their own, so that floods of other packets can
+ * neither delay them nor crowd them out.
+ */
+struct Control_queue {
+  char *slots;
+  int *lengths;
+  unsigned int head;
+  unsigned int tail;
+  unsigned long dropped;
+  int event_fd;
+};
+typedef struct Control_queue Control_queue;
+
+/*
+ * Struct Keepalives, when the forwarding thread last received a packet
+ * that doubles as a keepalive (in milliseconds, on the local monotonic
+ * clock): a link state packet relayed by each router ID, and a path vector
+ * packet sent from each port. They are stamped before the packets are
+ * queued, so that a neighbor whose keepalives are stuck in the control
+ * queue, or were dropped from it, isn't taken for lost (see
+ * check_timestamps()). Written by the forwarding thread only.
+ */
+struct Keepalives {
+  long int *by_id;
+  long int *by_port;
+};
+typedef struct Keepalives Keepalives;
+
 /*
  * Global variables
  */
 Router router;
-/* Following are variables while sending and initialized in initalize() */
-int sender_socket = -1;
-struct sockaddr_in sender_sin;
+Spf_state spf;
+Adjacency_bitmap bitmap = { NULL, NULL, NULL, NULL, TRUE, 0 };
+Fib fib = { NULL, NULL, NULL, NULL, TRUE, 0, 1 };
+Spf_throttle spf_throttle = { UNSET, SPF_HOLD_TIME, FALSE, 0, 0, 0, 0 };
+Lfa_state lfa;
+Control_queue control_queue;
+Control_queue hello_queue;
+Keepalives keepalives;
+Flood_tree flood_tree = { NULL, NULL, NULL, TRUE, TRUE, 0, 0, 0 };
+Timer_wheel timer_wheel = { NULL, { 0 }, 0, 0, 0, UNSET, UNSET };
+Path_table path_table;
+Policy policy;
+Control_socket control_socket = { NULL, NULL, 0 };
+Adaptive_timers adaptive = { -1, FLOOD_INTERVAL * 1000, -1,
+                             DEFAULT_HELLO_INTERVAL, 1, 0, 0, 0 };
+/*
+ * Odd while the forwarding thread is processing packets (and may hold a
+ * reference to a forwarding table), even while it waits for more.
+ */
+unsigned long forwarding_epoch = 1;
+/*
+ * Following are variables while sending, each thread has its own and
+ * initializes them in init_sender()
+ */
+struct in_addr localhost_addr;
+__thread int sender_socket = -1;
+__thread struct sockaddr_in sender_sin;
+/*
+ * Encoded packets that are sent to every neighbor. They are referenced
+ * (not copied) by the send queue, and rewritten on the next tick.
+ */
+Encoded_packet hello_packet;
+Encoded_packet lsa_packet;
+/* epoll instance used by the event loop, created in recv_and_handle() */
+int epoll_fd = -1;
+/*
+ * Datagrams received per wakeup by the forwarding thread, and packets
+ * waiting to be sent by each thread
+ */
+Batch rx_batch;
+__thread Batch tx_batch;
 
 /* Functions */
+int add_neighbor(int port, int cost);
+int add_node(int id);
+int check_command(const char *line);
+int create_timer(long int interval);
+int decode_link_state_packet(char *buff, int cc, Link_state_packet *p);
+int decode_msg_packet(char *buff, int cc, Msg_packet *p);
+int decode_ping_packet(char *buff, int cc, Ping_packet *p);
+int decode_pv_packet(char *buff, int cc, Pv_packet *p);
+int encode_link_state_packet(const Link_state_packet *p, void *buff, int size);
+int encode_msg_packet(const Msg_packet *p, void *buff, int size);
+int encode_ping_packet(const Ping_packet *p, void *buff, int size);
+int encode_pv_packet(const Pv_packet *p, void *buff, int size);
+int compare_distances(const void *a, const void *b);
+int compare_flood_edges(const void *a, const void *b);
+int compare_policy_rules(const void *a, const void *b);
 int dijkstra(int init);
+int evaluate_policy(int origin, const Path *path);
+int parse_policy_rule(char buff[80], Policy_rule *rule, int *via);
+int parse_prefer_policy(char buff[80], int *path, int *path_length);
+int run_batch(char *text, char *reply, int size);
+int flood_tree_find(int node);
 int initialize(int argc, char **argv);
+int is_rejected(int id);
+int is_usable_path(const Path *path);
+int path_contains(const Path *path, int id);
+int policy_rule_matches(const Policy_rule *rule, const Path *path);
+int lookup_node(int id);
+int new_timer(int kind, int index);
+int next_expired_timer(long int now);
+long int next_timer_tick();
+long int monotonic_time();
+long int last_keepalive(int i);
+Fib_index *hold_fib_index();
+Fib_table *build_fib_table();
+unsigned int flow_hash(unsigned int flow, unsigned int dest,
+                       unsigned int next_hop);
+int drain_control_queue(Control_queue *queue, int budget);
+int queue_control_packet(Control_queue *queue, const char *buff, int cc);
+int route_length(int index);
+int route_next_hop(int index);
+int select_path(const Fib_entry *entry, int dest, int flow);
+int route_path(int index, int *hops, int max);
+Link *find_link(int from, int to);
+char *read_file(const char *name);
+Path *hold_path(Path *path);
+Path *new_path(const int *hops, int length);
+uint64_t id_bloom(int id);
+unsigned int hash_hops(const int *hops, int length);
+void *forwarding_thread(void *arg);
+void add_event_source(int fd, void (*handle)(int fd));
+void add_policy_rule(char buff[80]);
+void append_policy_rule(const Policy_rule *rule);
+void apply_policy();
+void bitmap_update(int from, int to, int is_linked);
+void cancel_timer(int timer);
+void cascade_timers(int slot);
+void arm_expiry_timer(long int tick);
+void compile_policy();
 void check_timestamps();
+void clear_adj_rib_in(int i);
+void clear_adj_rib_out(int i);
+void install_lsa(int origin, Lsa *lsa);
 void create_peering_session(int id, int port, char key[10]);
+void flush_packets();
+void grow_path_table();
+void flush_pv_update(int i, Pv_packet *p);
+void forward_msg(int dest, int tunnel, int flow);
+void free_fib_table(Fib_table *table);
+void handle_console(int fd);
+void handle_control_client(int fd);
+void handle_control_socket(int fd);
+void handle_control_queue(int fd);
+void handle_expiry_timer(int fd);
+void handle_flood_timer(int fd);
+void handle_hello_timer(int fd);
+void handle_refresh_timer(int fd);
+void handle_socket(int fd);
 void handle_stdin(char buff[80]);
+void init_control_queue(Control_queue *queue, int event_fd);
+void init_sender();
+void stamp_keepalive(const char *buff, int cc, int type);
+void open_control_socket();
+void run_config_file(const char *name);
+void invalidate_fib();
+void record_link_change(int a, int b);
+void refresh_neighbor(int i);
+void reset_intervals();
+void back_off_interval(int *interval, int base, int max, int fd);
+void set_timer_interval(int fd, long int interval);
 void ping_neighbors();
 void print_neighbors();
 void print_router();
+void print_backups();
 void print_routing_table();
-void process_link_state_packet(Link_state_packet p);
-void process_msg_packet(Msg_packet p);
-void process_pv_packet(Pv_packet p);
+void process_link_state_packet(const Link_state_packet *p);
+void process_msg_packet(const Msg_packet *p);
+void process_packet(char *buff, int cc);
+void process_ping_packet(const Ping_packet *p);
+void process_pv_packet(const Pv_packet *p);
+void process_pv_route(int peer, const struct Path_vector *pv);
+void publish_fib_table(Fib_table *table);
 void recv_and_handle();
+void remove_event_source(int fd);
 void reject(int id);
-void send_data_packets();
-void send_msg(int dest);
-void send_one_packet(int port, int packet_type, Ping_packet pp,
-                     Msg_packet sp, Pv_packet pvp, Link_state_packet dpp);
+void release_fib_index(Fib_index *index);
+void release_path(Path *path);
+void request_refresh(int id);
+void withdraw_pv_route(int peer, int dest);
+void repair_fib(int next_hop);
+void mark_ecmp_affected(int node);
+void push_ecmp(int u, int start, int only_affected);
+void reset_ecmp(int i);
+void resolve_ecmp(int start);
+void resolve_touched_ecmp(int start);
+void schedule_spf();
+void select_pv_path(int index);
+void schedule_timer(int timer, long int expires);
+void wheel_timer(int timer);
+void remove_link(int a, int b);
+void originate_lsa(int force);
+void send_msg(int dest, int flow);
+void send_pv_update(int i);
+void send_packet(int port, const void *buff, int len);
+void send_packet_copy(int port, const void *buff, int len);
+void set_link(int a, int b, long int last_seen, int cost);
+void set_path(int index, Path *path);
+void sync_link(int a, int b);
+void spf_bfs(int start);
+void spf_bitset(int start);
+void spf_distances(int start, int *dist, int is_reverse);
+void spf_heap(int start);
+void update_fib();
+void update_flood_tree();
+void clear_lfas();
+void update_lfa_distances();
+void update_lfas();
 
 /*
 * int
@@ -153,45 +1021,74 @@ void send_one_packet(int port, int packet_type, Ping_packet pp,
 */
 int initialize(int argc, char **argv) {
 
-  /* Initialize the global variable `sender_sin` */
-  int myPVport, id, myLSport, i=1;
+  /* Resolve the address every thread sends to */
+  int myPVport, id, myLSport, value, i=1;
   struct hostent *hp;
   char host[10] = "localhost";
-  memset(&sender_sin, 0, sizeof(sender_sin));
-  sender_sin.sin_family = AF_INET;
   hp = gethostbyname(host);
-  memcpy(&sender_sin.sin_addr, hp->h_addr, sizeof(sender_sin.sin_addr));
+  memcpy(&localhost_addr, hp->h_addr, sizeof(localhost_addr));
+
+  router.is_border_router = FALSE;
+  router.hello_interval = DEFAULT_HELLO_INTERVAL;
+  router.detect_multiplier = DEFAULT_DETECT_MULTIPLIER;
+
+  /* Options come first, each with a value */
+  while(i + 1 < argc && argv[i][0] == '-') {
+    /* The control socket is the only option that isn't a number */
+    if(strcmp(argv[i], "-c") == 0) {
+      control_socket.path = argv[i + 1];
+      i += 2;
+      continue;
+    }
+    if(sscanf(argv[i + 1], "%d", &value) != 1)
+      return FAILURE;
 
-  /* Initialize global variable sender_socket */  
-	sender_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    /* Check to see if -b is passed, with myPVport */
+    if(strcmp(argv[i], "-b") == 0) {
+      router.is_border_router = TRUE;
+      myPVport = value;
+      router.myPVport = myPVport;
+    }
+    else if(strcmp(argv[i], "-i") == 0) {
+      if(value < TIMER_TICK || value > MAX_HELLO_INTERVAL) {
+        printf("Hello intervals should be in [%d,%d] ms\n", TIMER_TICK,
+               MAX_HELLO_INTERVAL);
+        return FAILURE;
+      }
+      router.hello_interval = value;
+    }
+    else if(strcmp(argv[i], "-d") == 0) {
+      if(value < 1 || value > MAX_DETECT_MULTIPLIER) {
+        printf("Detect multipliers should be in [1,%d]\n",
+               MAX_DETECT_MULTIPLIER);
+        return FAILURE;
+      }
+      router.detect_multiplier = value;
+    }
+    else if(strcmp(argv[i], "-a") == 0) {
+      if(value < 1 || value > MAX_BACKOFF_FACTOR) {
+        printf("Backoff factors should be in [1,%d]\n", MAX_BACKOFF_FACTOR);
+        return FAILURE;
+      }
+      adaptive.max_factor = value;
+    }
+    else
+      return FAILURE;
+    i += 2;
+  }
 
-  /* Make sure there are at least three arguments */
-  if(argc <= 3) {
+  /* Make sure there are at least three arguments left */
+  if(argc - i < 3) {
     printf("Too few arguments.\n"); 
     return FAILURE;
   }
 
-  /* Check to see if -b is passed */
-  if(strncmp(argv[1],"-b", 2) == 0) {
-    router.is_border_router = TRUE;
-
-    /* Get myPVport */
-    if(sscanf(argv[2], "%d", &myPVport) == 0) {
-      return FAILURE;
-    }
-    router.myPVport = myPVport;
-
-    i=3;
-  }
-  else
-    router.is_border_router = FALSE;
-
   /* Get ID */
   if(sscanf(argv[i++], "%d", &id) == 0) {
     return FAILURE;
   }
-  if(id < 0 || id > 19) {
-    printf("Router ID should be an integer in [0,19]");
+  if(id < 0 || id > MAX_ROUTER_ID) {
+    printf("Router ID should be an integer in [0,%d]", MAX_ROUTER_ID);
     return FAILURE;
   }
   router.id = id;
@@ -202,786 +1099,4638 @@ int initialize(int argc, char **argv) {
   }
   router.myLSport = myLSport;
 
-  /* Process all the neighbors */
-  /* FIXME: Kinda hacked -- maybe there's a more beautiful way? */
-  int j=0;
+  /* Process all the neighbors, given as port[:cost] */
   int num_neighbors = argc - i;
-  router.num_neighbors = num_neighbors;
   while(num_neighbors--) {
-    int neighbor_port;
-    if(sscanf(argv[i++], "%d", &(neighbor_port)) == 0) {
+    int neighbor_port, cost = DEFAULT_LINK_COST;
+    if(sscanf(argv[i++], "%d:%d", &(neighbor_port), &cost) == 0) {
+      return FAILURE;
+    }
+    else if(cost < 1 || cost > MAX_LINK_COST) {
+      printf("Link costs should be integers in [1,%d]\n", MAX_LINK_COST);
       return FAILURE;
     }
     else {
-			router.neighbors[j].id = -1;
-      router.neighbors[j].port = neighbor_port;
-      router.neighbors[j].last_seen = -1;
-      router.neighbors[j].is_paired = FALSE;
-      j++;
+      add_neighbor(neighbor_port, cost);
     }
   }
 
-  /* Initialize the router_matrix with 0s */
-  for(int i=0; i<20; i++) {
-    router.routing_table[i][0] = -1;
-    for(int j=0; j<20; j++)
-      router.network_matrix[i][j] = 0;
-  }
-
-  /* Initialize the is_preferred and is_rejected array with FALSEs */
-  for(int i=0; i<20; i++) {
-    router.is_preferred[i] = FALSE;
-    router.is_rejected[i] = FALSE;
-  }
-
-  /* Initialize the routing table of this router to itself */
-  router.routing_table[router.id][0] = router.id;
+  /* Add this router to the topology */
+  router.index = add_node(router.id);
 
   return SUCCESS;
 }
 
 /*
  * void
- * print_router
+ * init_sender
  *
- * For debugging. Prints all values associated with a router.
+ * Sets up the socket, address and send queue of the calling thread.
  */
-void print_router() {
-  printf("Border Router?: %d\n\n", router.is_border_router);
-  if(router.is_border_router == TRUE)
-    printf("myPVport: %d\n\n", router.myPVport);
-  printf("ID: %d\n\n", router.id);
-  printf("myLSport: %d\n\n", router.myLSport);
-  printf("Number of neighbors: %d\n\n", router.num_neighbors);
-  printf("Neighbors: ");
-  for(int i=0; i < router.num_neighbors; i++) {
-    printf("%d (%ld)\t", router.neighbors[i].port, router.neighbors[i].last_seen);
-  }
-  printf("\n\n");
-  printf("Current Neighbors:");
-  for(int i=0; i<20; i++) {
-    if(i%4 == 0)
-      printf("\n");
-    printf("%d\t", router.network_matrix[router.id][i]);
-  }
-  printf("\n\n");
+void init_sender() {
+  memset(&sender_sin, 0, sizeof(sender_sin));
+  sender_sin.sin_family = AF_INET;
+  sender_sin.sin_addr = localhost_addr;
 
-  printf("Neighbor pairs:\n");
-  for(int i=0; i<20; i++)
-    for(int j=0; j<20; j++)
-      if(router.network_matrix[i][j] != 0)
-        printf("%d:%d = %d\n", i, j, router.network_matrix[i][j]);
-    
-  printf("Is rejected...");
-  for(int i=0; i<20; i++)
-    printf("%d -> %d \n", i, router.uses_path_vector[i]);
-  printf("\n");
-}
+	sender_socket = socket(AF_INET, SOCK_DGRAM, 0);
 
+  if(batch_init(&tx_batch, BATCH_SIZE, RECV_BUFFER_SIZE) != SUCCESS)
+    exit(1);
+}
 
 /*
  * void
- * check_timestamps
+ * grow_array
  *
- * Looks through the network matrix, and eliminates all old entries.
+ * Grows `*array`, of `*max` elements of `size` bytes, so that it can hold
+ * at least `needed` elements. The new elements are zeroed.
  */
-void check_timestamps() {
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  long int current_time = now.tv_sec;
-  for(int i=0; i<20; i++) {
-    for(int j=0; j<20; j++) {
-      long int value = router.network_matrix[i][j];
-      if(value != 0) {
-        if(value < (current_time - NEIGHBOR_LAG)) {
-          router.network_matrix[i][j] = 0;
-          if(i == router.id) {
-            router.routing_table[j][0] = UNSET;
-          }
-        }
-      }
-    }
-  }
-}
+void grow_array(void **array, int *max, int needed, size_t size) {
+  int new_max = (*max > 0) ? *max : 4;
 
-/*
+  if(needed <= *max)
+    return;
+
+  while(new_max < needed)
+    new_max *= 2;
+
+  char *grown = realloc(*array, (size_t)new_max * size);
+  if(grown == NULL) {
+    perror("grow_array: realloc");
+    exit(1);
+  }
+  memset(grown + (size_t)*max * size, 0, (size_t)(new_max - *max) * size);
+
+  *array = grown;
+  *max = new_max;
+}
+
+/*
+ * int
+ * add_neighbor
+ *
+ * Adds a (not yet heard from) neighbor listening on `port`, reached over
+ * a link of cost `cost`, and returns its index in router.neighbors.
+ */
+int add_neighbor(int port, int cost) {
+  int max_rib_in = router.max_neighbors, max_rib_out = router.max_neighbors;
+  int i = router.num_neighbors;
+
+  grow_array((void **)&router.neighbors, &router.max_neighbors,
+             i + 1, sizeof(Neighbor));
+  grow_array((void **)&router.rib_in, &max_rib_in,
+             i + 1, sizeof(Adj_rib_in));
+  grow_array((void **)&router.rib_out, &max_rib_out,
+             i + 1, sizeof(Adj_rib_out));
+
+  router.neighbors[i].id = UNSET;
+  router.neighbors[i].expiry_timer = new_timer(NEIGHBOR_TIMER, i);
+  router.neighbors[i].cost = cost;
+  router.neighbors[i].port = port;
+  router.neighbors[i].last_seen = -1;
+  router.neighbors[i].is_up = FALSE;
+  router.neighbors[i].is_paired = FALSE;
+  router.num_neighbors = i + 1;
+
+  return i;
+}
+
+/*
+ * int
+ * lookup_node
+ *
+ * Returns the index of router `id` in the topology, or UNSET if it isn't
+ * known.
+ */
+int lookup_node(int id) {
+  if(id < 0 || id >= router.max_node_id)
+    return UNSET;
+  return router.node_index[id];
+}
+
+/*
+ * int
+ * add_node
+ *
+ * Returns the index of router `id` in the topology, adding it if it isn't
+ * known yet. Returns UNSET if `id` is not a valid router ID.
+ */
+int add_node(int id) {
+  int index = lookup_node(id);
+
+  if(index != UNSET)
+    return index;
+  if(id < 0 || id > MAX_ROUTER_ID)
+    return UNSET;
+
+  /* Grow the ID-to-index map, filling the new entries with UNSET */
+  if(id >= router.max_node_id) {
+    int old_max = router.max_node_id;
+    grow_array((void **)&router.node_index, &router.max_node_id,
+               id + 1, sizeof(int));
+    for(int i=old_max; i<router.max_node_id; i++)
+      router.node_index[i] = UNSET;
+  }
+
+  grow_array((void **)&router.nodes, &router.max_nodes,
+             router.num_nodes + 1, sizeof(Node));
+  index = router.num_nodes++;
+  router.nodes[index].id = id;
+  router.nodes[index].lsa_timer = new_timer(LSA_TIMER, index);
+  router.node_index[id] = index;
+
+  return index;
+}
+
+/*
+ * Path *
+ * new_path
+ *
+ * Returns a reference to the path going through the `length` routers
+ * listed in `hops`: the interned one if there is one, a new one otherwise.
+ * It has to be given back with release_path().
+ */
+Path *new_path(const int *hops, int length) {
+  unsigned int hash = hash_hops(hops, length);
+  Path *path;
+
+  if(path_table.num_buckets > 0) {
+    path = path_table.buckets[hash & (path_table.num_buckets - 1)];
+    for(; path != NULL; path = path->next)
+      if(path->hash == hash && path->length == length &&
+         memcmp(path->hops, hops, (size_t)length * sizeof(int)) == 0)
+        return hold_path(path);
+  }
+
+  path = malloc(sizeof(Path) + (size_t)length * sizeof(int));
+  if(path == NULL) {
+    perror("new_path: malloc");
+    exit(1);
+  }
+  path->hash = hash;
+  path->refs = 1;
+  path->bloom = 0;
+  path->length = length;
+  memcpy(path->hops, hops, (size_t)length * sizeof(int));
+  for(int i=0; i<length; i++)
+    path->bloom |= id_bloom(hops[i]);
+
+  if(path_table.num_paths >= path_table.num_buckets)
+    grow_path_table();
+  Path **bucket = &path_table.buckets[hash & (path_table.num_buckets - 1)];
+  path->next = *bucket;
+  *bucket = path;
+  path_table.num_paths++;
+  return path;
+}
+
+/*
+ * Path *
+ * hold_path
+ *
+ * Takes another reference to `path`, and returns it.
+ */
+Path *hold_path(Path *path) {
+  path->refs++;
+  return path;
+}
+
+/*
+ * void
+ * release_path
+ *
+ * Gives back a reference to `path`, which may be NULL. The last one frees
+ * it.
+ */
+void release_path(Path *path) {
+  if(path == NULL || --path->refs > 0)
+    return;
+
+  Path **link = &path_table.buckets[path->hash & (path_table.num_buckets - 1)];
+  while(*link != path)
+    link = &(*link)->next;
+  *link = path->next;
+  path_table.num_paths--;
+  free(path);
+}
+
+/*
+ * void
+ * grow_path_table
+ *
+ * Doubles the number of buckets of the path table, and rehashes the paths
+ * into them.
+ */
+void grow_path_table() {
+  int num_buckets = (path_table.num_buckets == 0) ? 64 :
+                    2 * path_table.num_buckets;
+  Path **buckets = calloc((size_t)num_buckets, sizeof(Path *));
+  if(buckets == NULL) {
+    perror("grow_path_table: calloc");
+    exit(1);
+  }
+
+  for(int i=0; i<path_table.num_buckets; i++) {
+    Path *path = path_table.buckets[i];
+    while(path != NULL) {
+      Path *next = path->next;
+      Path **bucket = &buckets[path->hash & (num_buckets - 1)];
+      path->next = *bucket;
+      *bucket = path;
+      path = next;
+    }
+  }
+  free(path_table.buckets);
+  path_table.buckets = buckets;
+  path_table.num_buckets = num_buckets;
+}
+
+/*
+ * unsigned int
+ * hash_hops
+ *
+ * FNV-1a hash of the `length` IDs in `hops`.
+ */
+unsigned int hash_hops(const int *hops, int length) {
+  unsigned int hash = 2166136261u;
+
+  for(int i=0; i<length; i++) {
+    hash ^= (unsigned int)hops[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * uint64_t
+ * id_bloom
+ *
+ * Returns the bit router `id` sets in the bloom filter of a path. IDs
+ * below 64 have one of their own, so the filter is exact in small
+ * networks.
+ */
+uint64_t id_bloom(int id) {
+  return (uint64_t)1 << (id & 63);
+}
+
+/*
+ * int
+ * path_contains
+ *
+ * Returns TRUE if router `id` is on `path`.
+ */
+int path_contains(const Path *path, int id) {
+  if((path->bloom & id_bloom(id)) == 0)
+    return FALSE;
+  for(int i=0; i<path->length; i++)
+    if(path->hops[i] == id)
+      return TRUE;
+  return FALSE;
+}
+
+/*
+ * void
+ * set_path
+ *
+ * Replaces the path that overrides the route to node `index`, which may be
+ * NULL. The node keeps its policy flags; one that is preferred or uses a
+ * path vector, but has no path, is unreachable.
+ */
+void set_path(int index, Path *path) {
+  release_path(router.nodes[index].path);
+  router.nodes[index].path = path;
+  invalidate_fib();
+}
+
+/*
+ * Link *
+ * find_link
+ *
+ * Returns the entry for the link to node `to` in the adjacency list of
+ * node `from` (both are indices), or NULL if there's no such link.
+ */
+Link *find_link(int from, int to) {
+  Node *node = &router.nodes[from];
+  for(int i=0; i<node->num_links; i++)
+    if(node->links[i].to == to)
+      return &node->links[i];
+  return NULL;
+}
+
+/*
+ * void
+ * set_link
+ *
+ * Records that the link between nodes `a` and `b` (indices) was last seen
+ * at `last_seen`, adding it to both adjacency lists if needed. `cost` is
+ * the cost from `a` to `b`; the reverse direction keeps its own cost, and
+ * is assumed to be symmetric until `b` says otherwise.
+ */
+void set_link(int a, int b, long int last_seen, int cost) {
+  int ends[2] = {a, b};
+
+  for(int i=0; i<2; i++) {
+    int from = ends[i], to = ends[1 - i];
+    Link *link = find_link(from, to);
+
+    if(link == NULL) {
+      Node *node = &router.nodes[from];
+      grow_array((void **)&node->links, &node->max_links,
+                 node->num_links + 1, sizeof(Link));
+      link = &node->links[node->num_links++];
+      link->to = to;
+      link->cost = cost;
+      bitmap_update(from, to, TRUE);
+      record_link_change(a, b);
+    }
+    else if(from == a && link->cost != cost) {
+      link->cost = cost;
+      record_link_change(a, b);
+    }
+    link->last_seen = last_seen;
+  }
+}
+
+/*
+ * void
+ * remove_link
+ *
+ * Removes the link between nodes `a` and `b` (indices) from both adjacency
+ * lists. The last entry of a list takes the place of the removed one.
+ */
+void remove_link(int a, int b) {
+  int ends[2] = {a, b};
+
+  for(int i=0; i<2; i++) {
+    Node *node = &router.nodes[ends[i]];
+    Link *link = find_link(ends[i], ends[1 - i]);
+
+    if(link != NULL) {
+      *link = node->links[--node->num_links];
+      bitmap_update(ends[i], ends[1 - i], FALSE);
+      record_link_change(a, b);
+    }
+  }
+}
+
+/*
+ * int
+ * sequence_is_newer
+ *
+ * Returns TRUE if sequence number `a` comes after `b`. Sequence numbers
+ * wrap around, so the comparison is on their difference.
+ */
+int sequence_is_newer(unsigned int a, unsigned int b) {
+  return (int)(a - b) > 0;
+}
+
+/*
+ * Link *
+ * lsa_find_link
+ *
+ * Returns the adjacency to node `to` (an index) listed in `lsa`, or NULL if
+ * `lsa` is NULL or doesn't list it.
+ */
+Link *lsa_find_link(Lsa *lsa, int to) {
+  if(lsa == NULL)
+    return NULL;
+  for(int i=0; i<lsa->num_links; i++)
+    if(lsa->links[i].to == to)
+      return &lsa->links[i];
+  return NULL;
+}
+
+/*
+ * void
+ * sync_link
+ *
+ * Brings the link between nodes `a` and `b` (indices) in line with their
+ * advertisements. It exists if one of them lists the other, and neither
+ * has an advertisement that doesn't. Each direction costs what its tail
+ * advertised, or the same as the other direction if it didn't say.
+ */
+void sync_link(int a, int b) {
+  Lsa *lsa_a = router.nodes[a].lsa, *lsa_b = router.nodes[b].lsa;
+  Link *ab = lsa_find_link(lsa_a, b), *ba = lsa_find_link(lsa_b, a);
+  long int now;
+
+  if(a == b)
+    return;
+
+  if((ab == NULL && ba == NULL) ||
+     (lsa_a != NULL && ab == NULL) || (lsa_b != NULL && ba == NULL)) {
+    remove_link(a, b);
+    return;
+  }
+
+  now = monotonic_time();
+  set_link(a, b, now, (ab != NULL) ? ab->cost : ba->cost);
+  set_link(b, a, now, (ba != NULL) ? ba->cost : ab->cost);
+}
+
+/*
+ * void
+ * install_lsa
+ *
+ * Makes `lsa` the advertisement of node `origin` in the link state
+ * database, or removes it if `lsa` is NULL, and updates the links it
+ * listed or lists accordingly. The old advertisement is freed. Those of
+ * the other routers age out LSA_MAX_AGE seconds after they are received.
+ */
+void install_lsa(int origin, Lsa *lsa) {
+  Lsa *old = router.nodes[origin].lsa;
+
+  router.nodes[origin].lsa = lsa;
+  if(lsa == NULL || origin == router.index)
+    cancel_timer(router.nodes[origin].lsa_timer);
+  else
+    schedule_timer(router.nodes[origin].lsa_timer,
+                   monotonic_time() + LSA_MAX_AGE * 1000L);
+  if(old != NULL)
+    for(int i=0; i<old->num_links; i++)
+      sync_link(origin, old->links[i].to);
+  if(lsa != NULL)
+    for(int i=0; i<lsa->num_links; i++)
+      sync_link(origin, lsa->links[i].to);
+  free(old);
+}
+
+/*
+ * void
+ * bitmap_update
+ *
+ * Mirrors the link from node `from` to node `to` (indices) coming up or
+ * going away in the adjacency bitmap. If the bitmap has no row or column
+ * for them yet, it is marked stale and rebuilt when next needed.
+ */
+void bitmap_update(int from, int to, int is_linked) {
+  int num_rows = bitmap.words * 64;
+  uint64_t bit = (uint64_t)1 << (to % 64);
+
+  if(bitmap.is_stale == TRUE || from >= num_rows || to >= num_rows) {
+    bitmap.is_stale = TRUE;
+    return;
+  }
+
+  if(is_linked == TRUE)
+    bitmap.rows[(size_t)from * bitmap.words + to / 64] |= bit;
+  else
+    bitmap.rows[(size_t)from * bitmap.words + to / 64] &= ~bit;
+}
+
+/*
+ * void
+ * bitmap_rebuild
+ *
+ * Sizes the adjacency bitmap for the current number of nodes, and fills it
+ * in from the adjacency lists.
+ */
+void bitmap_rebuild() {
+  int words = (router.num_nodes + 63) / 64;
+  size_t num_words = (size_t)words * 64 * words;
+
+  if(words != bitmap.words) {
+    free(bitmap.rows);
+    free(bitmap.visited);
+    free(bitmap.frontier);
+    free(bitmap.next);
+    bitmap.rows = malloc(num_words * sizeof(uint64_t));
+    bitmap.visited = malloc(words * sizeof(uint64_t));
+    bitmap.frontier = malloc(words * sizeof(uint64_t));
+    bitmap.next = malloc(words * sizeof(uint64_t));
+    if(bitmap.rows == NULL || bitmap.visited == NULL ||
+       bitmap.frontier == NULL || bitmap.next == NULL) {
+      perror("bitmap_rebuild: malloc");
+      exit(1);
+    }
+    bitmap.words = words;
+  }
+
+  memset(bitmap.rows, 0, num_words * sizeof(uint64_t));
+  bitmap.is_stale = FALSE;
+  for(int i=0; i<router.num_nodes; i++)
+    for(int j=0; j<router.nodes[i].num_links; j++)
+      bitmap_update(i, router.nodes[i].links[j].to, TRUE);
+}
+
+/*
+ * int
+ * is_rejected
+ *
+ * Returns TRUE if router `id` has been rejected.
+ */
+int is_rejected(int id) {
+  int index = lookup_node(id);
+  return (index != UNSET) && router.nodes[index].is_rejected;
+}
+
+/*
+ * Comparison function for qsort(), to print IDs in increasing order.
+ */
+int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * void
+ * print_router
+ *
+ * For debugging. Prints all values associated with a router.
+ */
+void print_router() {
+  printf("Border Router?: %d\n\n", router.is_border_router);
+  if(router.is_border_router == TRUE)
+    printf("myPVport: %d\n\n", router.myPVport);
+  printf("ID: %d\n\n", router.id);
+  printf("myLSport: %d\n\n", router.myLSport);
+  printf("Hello interval: %d ms, detect multiplier: %d\n\n",
+         router.hello_interval, router.detect_multiplier);
+  if(adaptive.max_factor > 1)
+    printf("Backed off to: hellos %d ms, path vectors %d ms, "
+           "hellos saved: %lu\n\n", adaptive.hello_interval,
+           adaptive.flood_interval, adaptive.hellos_saved);
+  printf("Number of neighbors: %d\n\n", router.num_neighbors);
+  printf("Neighbors: ");
+  for(int i=0; i < router.num_neighbors; i++) {
+    printf("%d (%ld)\t", router.neighbors[i].port, router.neighbors[i].last_seen);
+  }
+  printf("\n\n");
+  printf("Current Neighbors:");
+  Node *self = &router.nodes[router.index];
+  for(int i=0; i<self->num_links; i++) {
+    if(i%4 == 0)
+      printf("\n");
+    printf("%d (%ld)\t", router.nodes[self->links[i].to].id,
+           self->links[i].last_seen);
+  }
+  printf("\n\n");
+
+  printf("Neighbor pairs:\n");
+  for(int i=0; i<router.num_nodes; i++)
+    for(int j=0; j<router.nodes[i].num_links; j++) {
+      Link *link = &router.nodes[i].links[j];
+      printf("%d:%d = %ld\n", router.nodes[i].id, router.nodes[link->to].id,
+             link->last_seen);
+    }
+    
+  printf("Link state database:\n");
+  for(int i=0; i<router.num_nodes; i++)
+    if(router.nodes[i].lsa != NULL)
+      printf("%d: sequence %u, %d neighbors\n", router.nodes[i].id,
+             router.nodes[i].lsa->sequence, router.nodes[i].lsa->num_links);
+  printf("\n");
+
+  printf("Control packets dropped: %lu, hellos dropped: %lu\n\n",
+         __atomic_load_n(&control_queue.dropped, __ATOMIC_RELAXED),
+         __atomic_load_n(&hello_queue.dropped, __ATOMIC_RELAXED));
+
+  printf("Flooding: %s, duplicate floods avoided: %lu\n",
+         (flood_tree.is_enabled == TRUE) ? "spanning tree" : "every neighbor",
+         flood_tree.floods_avoided);
+  printf("Route computations: %lu, suppressed: %lu, hold time: %d ms\n",
+         spf_throttle.num_runs, spf_throttle.num_suppressed,
+         spf_throttle.hold);
+  printf("Distinct paths stored: %d\n", path_table.num_paths);
+  printf("Policy rules: %d\n", policy.num_rules);
+  if(flood_tree.is_enabled == TRUE) {
+    update_flood_tree();
+    printf("Flooding tree neighbors:");
+    for(int i=0; i<router.num_nodes && i<flood_tree.max_nodes; i++)
+      if(flood_tree.is_tree_neighbor[i] == TRUE)
+        printf(" %d", router.nodes[i].id);
+    printf("\n");
+  }
+  printf("\n");
+
+  printf("Is rejected...");
+  for(int i=0; i<router.num_nodes; i++)
+    printf("%d -> %d \n", router.nodes[i].id, router.nodes[i].uses_path_vector);
+  printf("\n");
+}
+
+
+/*
+ * long int
+ * monotonic_time
+ *
+ * Returns the time in milliseconds on the monotonic clock, which only
+ * makes sense compared to other times from it on this host.
+ */
+long int monotonic_time() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * int
+ * new_timer
+ *
+ * Returns a new, unscheduled, timer of kind `kind` for the neighbor or
+ * node `index`.
+ */
+int new_timer(int kind, int index) {
+  int timer = timer_wheel.num_timers;
+
+  /* The slots start out empty, and the wheel at the current time */
+  if(timer_wheel.max_timers == 0) {
+    for(int i=0; i<2 * TIMER_WHEEL_SIZE; i++)
+      timer_wheel.slots[i] = UNSET;
+    timer_wheel.current = monotonic_time() / TIMER_TICK;
+  }
+
+  grow_array((void **)&timer_wheel.timers, &timer_wheel.max_timers,
+             timer + 1, sizeof(Timer));
+  timer_wheel.timers[timer].kind = kind;
+  timer_wheel.timers[timer].index = index;
+  timer_wheel.timers[timer].slot = UNSET;
+  timer_wheel.num_timers++;
+
+  return timer;
+}
+
+/*
+ * void
+ * cancel_timer
+ *
+ * Takes `timer` out of the wheel, if it is scheduled.
+ */
+void cancel_timer(int timer) {
+  Timer *t = &timer_wheel.timers[timer];
+
+  if(t->slot == UNSET)
+    return;
+  if(t->prev == UNSET)
+    timer_wheel.slots[t->slot] = t->next;
+  else
+    timer_wheel.timers[t->prev].next = t->next;
+  if(t->next != UNSET)
+    timer_wheel.timers[t->next].prev = t->prev;
+  t->slot = UNSET;
+}
+
+/*
+ * void
+ * wheel_timer
+ *
+ * Puts the unscheduled `timer` in the slot its expiry time hashes to. A
+ * time that has already been expired goes in the slot being expired.
+ */
+void wheel_timer(int timer) {
+  Timer *t = &timer_wheel.timers[timer];
+  long int when = (t->expires < timer_wheel.current) ?
+                  timer_wheel.current : t->expires;
+
+  if(when - timer_wheel.current < TIMER_WHEEL_SIZE)
+    t->slot = when % TIMER_WHEEL_SIZE;
+  else
+    t->slot = TIMER_WHEEL_SIZE + (when / TIMER_WHEEL_SIZE) % TIMER_WHEEL_SIZE;
+  t->prev = UNSET;
+  t->next = timer_wheel.slots[t->slot];
+  if(t->next != UNSET)
+    timer_wheel.timers[t->next].prev = timer;
+  timer_wheel.slots[t->slot] = timer;
+}
+
+/*
+ * void
+ * schedule_timer
+ *
+ * (Re)schedules `timer` to go off at `expires`, in milliseconds on the
+ * monotonic clock. It is rounded up to the next tick. The expiry timerfd
+ * is brought forward if it comes first.
+ */
+void schedule_timer(int timer, long int expires) {
+  cancel_timer(timer);
+  timer_wheel.timers[timer].expires = (expires + TIMER_TICK - 1) / TIMER_TICK;
+  wheel_timer(timer);
+  if(timer_wheel.armed == UNSET ||
+     timer_wheel.timers[timer].expires < timer_wheel.armed)
+    arm_expiry_timer(timer_wheel.timers[timer].expires);
+}
+
+/*
+ * void
+ * cascade_timers
+ *
+ * Moves the timers in slot `slot` of the second level down to the first
+ * one, or back to the second level if they are more than a turn away.
+ */
+void cascade_timers(int slot) {
+  int next, timer = timer_wheel.slots[TIMER_WHEEL_SIZE + slot];
+
+  timer_wheel.slots[TIMER_WHEEL_SIZE + slot] = UNSET;
+  for(; timer != UNSET; timer = next) {
+    next = timer_wheel.timers[timer].next;
+    wheel_timer(timer);
+  }
+}
+
+/*
+ * int
+ * next_expired_timer
+ *
+ * Moves the wheel forward to `now` (in milliseconds on the monotonic
+ * clock), and returns the next timer that went off on the way, after
+ * taking it out of the wheel, or UNSET once there are none left. Only the
+ * slots that were passed are looked at, and everything in the slots of
+ * the first level is due by the time they are reached.
+ */
+int next_expired_timer(long int now) {
+  now /= TIMER_TICK;
+
+  while(TRUE) {
+    int timer = timer_wheel.slots[timer_wheel.current % TIMER_WHEEL_SIZE];
+    if(timer != UNSET) {
+      cancel_timer(timer);
+      return timer;
+    }
+    if(timer_wheel.current >= now)
+      return UNSET;
+    timer_wheel.current++;
+    if(timer_wheel.current % TIMER_WHEEL_SIZE == 0)
+      cascade_timers((timer_wheel.current / TIMER_WHEEL_SIZE) %
+                     TIMER_WHEEL_SIZE);
+  }
+}
+
+/*
+ * long int
+ * next_timer_tick
+ *
+ * Returns the tick the wheel next has to be moved forward to: that of the
+ * first timer due in the first level, or the start of the turn of the
+ * first slot of the second level that isn't empty, if it comes before, so
+ * that its timers move down in time. Returns UNSET if no timer is
+ * scheduled.
+ */
+long int next_timer_tick() {
+  long int next = UNSET, turn = timer_wheel.current / TIMER_WHEEL_SIZE;
+
+  for(int i=0; i<TIMER_WHEEL_SIZE; i++)
+    if(timer_wheel.slots[(timer_wheel.current + i) % TIMER_WHEEL_SIZE] !=
+       UNSET) {
+      next = timer_wheel.current + i;
+      break;
+    }
+  for(int i=1; i<=TIMER_WHEEL_SIZE; i++)
+    if(timer_wheel.slots[TIMER_WHEEL_SIZE + (turn + i) % TIMER_WHEEL_SIZE] !=
+       UNSET) {
+      if(next == UNSET || (turn + i) * TIMER_WHEEL_SIZE < next)
+        next = (turn + i) * TIMER_WHEEL_SIZE;
+      break;
+    }
+  return next;
+}
+
+/*
+ * void
+ * arm_expiry_timer
+ *
+ * Makes the expiry timerfd go off once, at tick `tick` (right away if it
+ * has passed), or disarms it if `tick` is UNSET. Nothing is done before
+ * the event loop has created the timerfd.
+ */
+void arm_expiry_timer(long int tick) {
+  struct itimerspec spec;
+
+  if(timer_wheel.fd == UNSET || tick == timer_wheel.armed)
+    return;
+  memset(&spec, 0, sizeof(spec));
+  if(tick != UNSET) {
+    spec.it_value.tv_sec = tick * TIMER_TICK / 1000;
+    spec.it_value.tv_nsec = (tick * TIMER_TICK % 1000) * 1000000;
+  }
+  if(timerfd_settime(timer_wheel.fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    perror("arm_expiry_timer: timerfd_settime");
+    exit(1);
+  }
+  timer_wheel.armed = tick;
+}
+
+/*
+ * void
+ * check_timestamps
+ *
+ * Drops the advertisements that haven't been refreshed in LSA_MAX_AGE
+ * seconds from the link state database, and advertises the neighbors
+ * that missed too many hellos. Only the timers that went off are looked
+ * at. Traffic through a lost neighbor moves to the backups right away;
+ * the routes are computed when the throttle says so.
+ */
+void check_timestamps() {
+  int timer, is_neighbor_lost = FALSE, is_spf_due = FALSE;
+
+  while((timer = next_expired_timer(monotonic_time())) != UNSET) {
+    Timer *t = &timer_wheel.timers[timer];
+    if(t->kind == LSA_TIMER)
+      install_lsa(t->index, NULL);
+    else if(t->kind == SPF_TIMER)
+      is_spf_due = TRUE;
+    else {
+      Neighbor *neighbor = &router.neighbors[t->index];
+      long int heard = last_keepalive(t->index);
+
+      /* Its keepalives may not have been through the control queue yet */
+      if(heard > neighbor->last_seen &&
+         heard + neighbor->hold_time > monotonic_time()) {
+        neighbor->last_seen = heard;
+        schedule_timer(neighbor->expiry_timer, heard + neighbor->hold_time);
+        continue;
+      }
+      neighbor->is_up = FALSE;
+      is_neighbor_lost = TRUE;
+      if(neighbor->id != UNSET)
+        repair_fib(neighbor->id);
+
+      /* A lost peer's paths go, and it gets all of ours when it's back */
+      if(neighbor->is_paired == TRUE) {
+        clear_adj_rib_in(t->index);
+        clear_adj_rib_out(t->index);
+        router.rib_out[t->index].is_synced = FALSE;
+      }
+    }
+  }
+
+  /* The lost neighbors are left out of the next advertisement */
+  if(is_neighbor_lost == TRUE)
+    originate_lsa(FALSE);
+
+  if(is_spf_due == TRUE)
+    update_fib();
+}
+
+/*
+ * void
+ * set_prefer_policy
+ *
+ * Takes a string of the form "P <num_stops> <stop1> <stop2> ..."
+ * and updates the routing table accordingly.
+ */
+void set_prefer_policy(char buff[80]) {
+  int path[MAX_PATH], path_length, i;
+
+  if(parse_prefer_policy(buff, path, &path_length) != SUCCESS)
+    return;
+  int dest = path[path_length - 1];
+  int index = add_node(dest);
+  set_path(index, new_path(path, path_length));
+  router.nodes[index].is_preferred = TRUE;
+
+  printf("Prefer policy set: ");
+  printf("%d -> ", router.id);
+  for(i=0; i< path_length-1; i++)
+    printf("%d -> ", path[i]);
+  printf("%d\n\n", dest);
+}
+
+/*
+ * int
+ * parse_prefer_policy
+ *
+ * Parses the prefer policy in `buff` (see set_prefer_policy()), into the
+ * `path_length` stops of `path`. Returns FAILURE, after saying why, if it
+ * isn't valid.
+ */
+int parse_prefer_policy(char buff[80], int *path, int *path_length) {
+  char *token = strtok(buff, " ");
+  token = strtok(NULL, " ");
+  *path_length = (token != NULL) ? atoi(token) : 0;
+  if(*path_length < 1 || *path_length > MAX_PATH) {
+    printf("Path length should be an integer in [1,%d].\n\n", MAX_PATH);
+    return FAILURE;
+  }
+  token = strtok(NULL, " ");
+  int i=0;
+  while(token != NULL && i < *path_length)
+  {
+    path[i] = atoi(token);
+    token = strtok(NULL, " ");
+    i++;
+  }
+  if(i < *path_length) {
+    printf("Expected %d stops.\n\n", *path_length);
+    return FAILURE;
+  }
+  int dest = path[*path_length - 1];
+  if(dest < 0 || dest > MAX_ROUTER_ID) {
+    printf("Invalid router ID specified.\n\n");
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/*
+ * void
+ * handle_stdin
+ *
+ * Handle the standard input from the user and call the appropriate
+ * functions
+ */
+void handle_stdin(char buff[80]) {  
+  char c;
+  int i, n, flow;
+
+  /* If only one character is present */
+  if(sscanf(buff, "%c", &c) == 1) {
+    switch(buff[0]) {
+      case 'N':
+        print_neighbors();
+        return;
+      case 'T':
+        print_routing_table();
+        return;
+      case 'p':
+        print_router();
+        return;
+      case 'L':
+        print_backups();
+        return;
+      case 'F':
+        flood_tree.is_enabled = !flood_tree.is_enabled;
+        printf("Flooding over the %s.\n\n", (flood_tree.is_enabled == TRUE) ?
+               "spanning tree" : "links to every neighbor");
+        fflush(stdout);
+        return;
+    }
+  }
+
+  /* To send messages, as part of a given flow or of this router's */
+  if((n = sscanf(buff, "%d %d", &i, &flow)) >= 1) {
+    if(n == 1)
+      flow = router.id;
+    if(i >= 0 && i <= MAX_ROUTER_ID && flow >= 0)
+      send_msg(i, flow);
+      return;
+  }
+
+  /* Reject policy */
+ 	if(sscanf(buff, "R %d", &i) == 1) {
+    if(i < 0 || i > MAX_ROUTER_ID)
+      printf("Invalid router ID specified.");
+		else if(router.is_border_router == FALSE) {
+			printf("Reject commands can be run only on border routers.\n");
+		}
+		else {
+			printf("Router rejected: %d.", i);
+      reject(i);
+    }
+    printf("\n\n");
+		fflush(stdout);
+		return;
+	}
+
+  /* Policy rules */
+  if(buff[0] == 'A') {
+    if(router.is_border_router == FALSE)
+      printf("Policy rules can be set only on border routers.\n\n");
+    else
+      add_policy_rule(buff);
+    fflush(stdout);
+    return;
+  }
+
+  /* Prefer policy */
+  if(buff[0] == 'P') {
+		if(router.is_border_router == FALSE) {
+			printf("Commands to set preferred paths can be run only on \
+              border routers.\n\n");
+      fflush(stdout);
+      return;
+		}
+
+    set_prefer_policy(buff);
+
+    return;
+  }
+
+  int id, port;
+  char key[10], name[MAX_COMMAND];
+
+  /* Run the commands of a configuration file as one batch */
+  if(sscanf(buff, "C %79s", name) == 1) {
+    run_config_file(name);
+    fflush(stdout);
+    return;
+  }
+
+  /* Ask a peer for all of its paths again */
+  if(sscanf(buff, "U %d", &id) == 1) {
+    request_refresh(id);
+    fflush(stdout);
+    return;
+  }
+
+  /* Create a peering session */
+  if(sscanf(buff, "S %d %d %9s", &id, &port, key) == 3) {
+		if(router.is_border_router == FALSE) {
+			printf("Commands to create a peering session can be run only on \
+              border routers.");
+    }
+    else {
+      create_peering_session(id, port, key);
+    }
+    printf("\n\n");
+    fflush(stdout);
+    return;
+  
+  }
+
+  printf("Invalid command.\n\n");
+  return;
+      
+}
+
+/*
+ * void
+ * request_refresh
+ *
+ * Asks the peer with ID `id` for all of its paths, until it answers.
+ */
+void request_refresh(int id) {
+  for(int i=0; i<router.num_neighbors; i++) {
+    if(router.neighbors[i].is_paired == TRUE &&
+       router.neighbors[i].id == id) {
+      router.rib_out[i].is_synced = FALSE;
+      send_pv_update(i);
+      printf("Refresh requested from router %d.\n\n", id);
+      return;
+    }
+  }
+  printf("No peering session with router %d.\n\n", id);
+}
+
+/*
+ * void
+ * reject
+ *
+ * Sets up reject policy for router with id=`id`
+ */
+void reject(int id) {
+  int index = add_node(id);
+  router.nodes[index].is_rejected = TRUE;
+  router.rejected_bloom |= id_bloom(id);
+  invalidate_fib();
+
+  /* Move the routes through it to other paths, if they have any */
+  for(int i=0; i<router.num_nodes; i++) {
+    Node *node = &router.nodes[i];
+    if(node->path == NULL || path_contains(node->path, id) == FALSE)
+      continue;
+    if(node->is_preferred == TRUE)
+      set_path(i, NULL);
+    else
+      select_pv_path(i);
+  }
+}
+
+/*
+ * void
+ * add_policy_rule
+ *
+ * Takes a string of the form
+ * "A <reject | prefer | pref <local_pref>> [origin <id>] [via <id> ...]
+ * [length <min> <max>]", adds the rule to the end of the policy, and
+ * applies it.
+ */
+void add_policy_rule(char buff[80]) {
+  Policy_rule rule;
+  int via[MAX_PATH];
+
+  if(parse_policy_rule(buff, &rule, via) != SUCCESS)
+    return;
+  append_policy_rule(&rule);
+  apply_policy();
+
+  printf("Policy rule %d added.\n\n", policy.num_rules);
+}
+
+/*
+ * int
+ * parse_policy_rule
+ *
+ * Parses the rule in `buff` (see add_policy_rule()) into `rule`, its
+ * routers into `via`. Returns FAILURE, after saying why, if it isn't
+ * valid.
+ */
+int parse_policy_rule(char buff[80], Policy_rule *rule, int *via) {
+  Policy_rule parsed = { UNSET, 0, MAX_PATH, POLICY_LOCAL_PREF,
+                         MAX_LOCAL_PREF, NULL, 0, 0 };
+  char *token = strtok(buff, " \n");
+
+  token = strtok(NULL, " \n");
+  if(token != NULL && strcmp(token, "reject") == 0)
+    parsed.action = POLICY_REJECT;
+  else if(token != NULL && strcmp(token, "pref") == 0) {
+    token = strtok(NULL, " \n");
+    parsed.local_pref = (token != NULL) ? atoi(token) : UNSET;
+    if(parsed.local_pref < 0 || parsed.local_pref > MAX_LOCAL_PREF) {
+      printf("Local preference should be an integer in [0,%d].\n\n",
+             MAX_LOCAL_PREF);
+      return FAILURE;
+    }
+  }
+  else if(token == NULL || strcmp(token, "prefer") != 0) {
+    printf("Expected reject, prefer or pref <local_pref>.\n\n");
+    return FAILURE;
+  }
+
+  char *keyword = strtok(NULL, " \n");
+  while(keyword != NULL) {
+    char *value = strtok(NULL, " \n");
+    if(strcmp(keyword, "origin") == 0 && value != NULL)
+      parsed.origin = atoi(value);
+    else if(strcmp(keyword, "length") == 0 && value != NULL) {
+      parsed.min_length = atoi(value);
+      value = strtok(NULL, " \n");
+      parsed.max_length = (value != NULL) ? atoi(value) : UNSET;
+    }
+    else if(strcmp(keyword, "via") == 0 && value != NULL) {
+      /* The routers listed go up to the next keyword */
+      while(value != NULL && strcmp(value, "origin") != 0 &&
+            strcmp(value, "length") != 0 && parsed.num_via < MAX_PATH) {
+        via[parsed.num_via++] = atoi(value);
+        value = strtok(NULL, " \n");
+      }
+      keyword = value;
+      continue;
+    }
+    else {
+      printf("Invalid rule.\n\n");
+      return FAILURE;
+    }
+    keyword = strtok(NULL, " \n");
+  }
+
+  if(parsed.origin != UNSET &&
+     (parsed.origin < 0 || parsed.origin > MAX_ROUTER_ID)) {
+    printf("Invalid router ID specified.\n\n");
+    return FAILURE;
+  }
+  if(parsed.min_length < 0 || parsed.max_length < parsed.min_length) {
+    printf("Invalid path length range.\n\n");
+    return FAILURE;
+  }
+  for(int i=0; i<parsed.num_via; i++) {
+    if(via[i] < 0 || via[i] > MAX_ROUTER_ID) {
+      printf("Invalid router ID specified.\n\n");
+      return FAILURE;
+    }
+    parsed.via_bloom |= id_bloom(via[i]);
+  }
+
+  parsed.via = via;
+  *rule = parsed;
+  return SUCCESS;
+}
+
+/*
+ * void
+ * append_policy_rule
+ *
+ * Adds a copy of `rule` to the end of the policy. It only applies to the
+ * routes once apply_policy() is called.
+ */
+void append_policy_rule(const Policy_rule *rule) {
+  Policy_rule copy = *rule;
+
+  copy.via = NULL;
+  if(rule->num_via > 0) {
+    copy.via = malloc((size_t)rule->num_via * sizeof(int));
+    if(copy.via == NULL) {
+      perror("append_policy_rule: malloc");
+      exit(1);
+    }
+    memcpy(copy.via, rule->via, (size_t)rule->num_via * sizeof(int));
+  }
+  grow_array((void **)&policy.rules, &policy.max_rules,
+             policy.num_rules + 1, sizeof(Policy_rule));
+  policy.rules[policy.num_rules++] = copy;
+  policy.is_dirty = TRUE;
+}
+
+/*
+ * void
+ * compile_policy
+ *
+ * Sorts the rules by origin, into the structure evaluate_policy() looks
+ * them up in.
+ */
+void compile_policy() {
+  int num_rules = policy.num_rules, num_specific = 0;
+  int max_origins = policy.max_compiled, max_starts = policy.max_compiled;
+  int max_any = policy.max_compiled;
+
+  grow_array((void **)&policy.origins, &max_origins, num_rules + 1,
+             sizeof(int));
+  grow_array((void **)&policy.starts, &max_starts, num_rules + 1,
+             sizeof(int));
+  grow_array((void **)&policy.any, &max_any, num_rules + 1, sizeof(int));
+  grow_array((void **)&policy.by_origin, &policy.max_compiled,
+             num_rules + 1, sizeof(int));
+
+  policy.num_any = 0;
+  for(int i=0; i<num_rules; i++) {
+    if(policy.rules[i].origin == UNSET)
+      policy.any[policy.num_any++] = i;
+    else
+      policy.by_origin[num_specific++] = i;
+  }
+  qsort(policy.by_origin, num_specific, sizeof(int), compare_policy_rules);
+
+  policy.num_origins = 0;
+  for(int i=0; i<num_specific; i++) {
+    int origin = policy.rules[policy.by_origin[i]].origin;
+    if(policy.num_origins == 0 ||
+       policy.origins[policy.num_origins - 1] != origin) {
+      policy.origins[policy.num_origins] = origin;
+      policy.starts[policy.num_origins++] = i;
+    }
+  }
+  policy.starts[policy.num_origins] = num_specific;
+  policy.is_dirty = FALSE;
+}
+
+/*
+ * Comparison function for qsort(), to order rules (by index) by origin,
+ * keeping those of an origin in order.
+ */
+int compare_policy_rules(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  int origin_x = policy.rules[x].origin, origin_y = policy.rules[y].origin;
+
+  if(origin_x != origin_y)
+    return (origin_x > origin_y) - (origin_x < origin_y);
+  return (x > y) - (x < y);
+}
+
+/*
+ * int
+ * evaluate_policy
+ *
+ * Returns the local preference the policy gives `path` to `origin`, or
+ * UNSET if it rejects it. With a NULL path, it tells whether the
+ * advertisements of `origin` are rejected, by the rules that only name
+ * the origin.
+ */
+int evaluate_policy(int origin, const Path *path) {
+  int first = 0, last = 0, next_any = 0;
+
+  if(policy.is_dirty == TRUE)
+    compile_policy();
+
+  /* Find the rules of the origin */
+  int low = 0, high = policy.num_origins;
+  while(low < high) {
+    int middle = (low + high) / 2;
+    if(policy.origins[middle] < origin)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if(low < policy.num_origins && policy.origins[low] == origin) {
+    first = policy.starts[low];
+    last = policy.starts[low + 1];
+  }
+
+  /* Go through them and those for any origin, in order */
+  while(first < last || next_any < policy.num_any) {
+    int rule;
+    if(next_any == policy.num_any ||
+       (first < last && policy.by_origin[first] < policy.any[next_any]))
+      rule = policy.by_origin[first++];
+    else
+      rule = policy.any[next_any++];
+
+    if(policy_rule_matches(&policy.rules[rule], path) == TRUE)
+      return (policy.rules[rule].action == POLICY_REJECT) ? UNSET :
+             policy.rules[rule].local_pref;
+  }
+  return DEFAULT_LOCAL_PREF;
+}
+
+/*
+ * int
+ * policy_rule_matches
+ *
+ * Returns TRUE if `rule` applies to `path`, whose origin it was looked up
+ * for. A NULL path only matches the rules that name nothing but the
+ * origin. The routers before the destination are compared with those of
+ * the rule only if the bloom filters say one of them might be there.
+ */
+int policy_rule_matches(const Policy_rule *rule, const Path *path) {
+  if(path == NULL)
+    return rule->num_via == 0 && rule->min_length == 0 &&
+           rule->max_length == MAX_PATH;
+  if(path->length < rule->min_length || path->length > rule->max_length)
+    return FALSE;
+  if(rule->num_via == 0)
+    return TRUE;
+  if((path->bloom & rule->via_bloom) == 0)
+    return FALSE;
+
+  for(int i=0; i<path->length - 1; i++) {
+    if((id_bloom(path->hops[i]) & rule->via_bloom) == 0)
+      continue;
+    for(int j=0; j<rule->num_via; j++)
+      if(rule->via[j] == path->hops[i])
+        return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * void
+ * apply_policy
+ *
+ * Evaluates the paths in the Adj-RIBs-In against the policy again, selects
+ * the routes accordingly, and drops the advertisements it now rejects from
+ * the link state database.
+ */
+void apply_policy() {
+  for(int i=0; i<router.num_neighbors; i++) {
+    Adj_rib_in *rib = &router.rib_in[i];
+    for(int j=0; j<rib->max_paths; j++)
+      if(rib->paths[j] != NULL)
+        rib->prefs[j] = evaluate_policy(router.nodes[j].id, rib->paths[j]);
+  }
+
+  for(int i=0; i<router.num_nodes; i++) {
+    select_pv_path(i);
+    if(i != router.index && router.nodes[i].lsa != NULL &&
+       evaluate_policy(router.nodes[i].id, NULL) == UNSET)
+      install_lsa(i, NULL);
+  }
+}
+
+/*
+ * void
+ * create_peering_session
+ *
+ * Sets up a peering session w/ router with given args
+ */
+void create_peering_session(int id, int port, char key[10]) {
+  int i = add_neighbor(port, DEFAULT_LINK_COST);
+  router.neighbors[i].id = id;
+  router.neighbors[i].is_paired = TRUE;
+  strncpy(router.neighbors[i].key, key, 10);
+  invalidate_fib();
+  printf("Session created with router %d at port %d using key %s.", 
+          id, port, key);
+}
+
+/*
+ * void
+ * send_msg
+ *
+ * Send a message to `dest` (as part of a msg sent via the console), in
+ * flow `flow`
+ */
+void send_msg(int dest, int flow) {
+  forward_msg(dest, UNSET, flow);
+}
+
+/*
+ * void
+ * forward_msg
+ *
+ * Sends a message to `dest` on to its next hop, as found in the published
+ * forwarding table, going through `tunnel` first unless it is UNSET. A
+ * message sent to a remote LFA is tunneled to it; it isn't tunneled again
+ * on the way. If there are several equal cost next hops, `flow` picks one.
+ * Called from both threads; the forwarding thread must be in its
+ * processing (odd) epoch.
+ */
+void forward_msg(int dest, int tunnel, int flow) {
+
+  /* initialize packet */
+  Msg_packet p;
+  char buff[WIRE_HEADER_SIZE + 3 * WIRE_MAX_VARINT];
+  int target = (tunnel != UNSET) ? tunnel : dest;
+  p.dest = dest;
+  p.flow = flow;
+
+  Fib_entry entry = { .next_hop = UNSET, .port = UNSET, .tunnel = UNSET,
+                      .backup_next_hop = UNSET, .backup_port = UNSET,
+                      .backup_tunnel = UNSET, .num_paths = 0 };
+  Fib_table *table = __atomic_load_n(&fib.table, __ATOMIC_SEQ_CST);
+
+  if(table != NULL && target >= 0 && target < table->index->max_node_id &&
+     table->index->slots[target] != UNSET)
+    entry = table->entries[table->index->slots[target]];
+  p.tunnel = (tunnel != UNSET) ? tunnel : entry.tunnel;
+
+  /* Spread the flows over the equal cost next hops */
+  if(entry.num_paths > 1) {
+    int k = select_path(&entry, target, flow);
+    entry.next_hop = entry.path_next_hops[k];
+    entry.port = entry.path_ports[k];
+  }
+
+  /* If the node is unreachable, drop the packet */
+	if(entry.next_hop == UNSET) {
+		printf("Unable to send message to %d.\n\n", dest);
+		return;
+	}
+
+  /* If not, send it on to the next hop */
+  if(entry.port != UNSET)
+    send_packet_copy(entry.port, buff, encode_msg_packet(&p, buff, sizeof(buff)));
+
+  printf("%d\n\n", entry.next_hop);
+  fflush(stdout);
+
+}
+
+/*
+ * unsigned int
+ * flow_hash
+ *
+ * Hashes a flow, its destination and a candidate next hop together.
+ */
+unsigned int flow_hash(unsigned int flow, unsigned int dest,
+                       unsigned int next_hop) {
+  unsigned int values[] = { flow, dest, next_hop }, h = 0;
+
+  for(int i=0; i<3; i++) {
+    h = (h ^ values[i]) * 0x9e3779b1u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+  }
+  return h;
+}
+
+/*
+ * int
+ * select_path
+ *
+ * Returns the position of the next hop that messages of flow `flow` to
+ * `dest` take among the equal cost ones of `entry`: the one the flow
+ * hashes highest with. A flow only moves when its next hop goes away,
+ * and the flows of a next hop that went away are spread over the others.
+ */
+int select_path(const Fib_entry *entry, int dest, int flow) {
+  unsigned int best_hash = 0;
+  int best = 0;
+
+  for(int k=0; k<entry->num_paths; k++) {
+    unsigned int hash = flow_hash(flow, dest, entry->path_next_hops[k]);
+    if(k == 0 || hash > best_hash) {
+      best = k;
+      best_hash = hash;
+    }
+  }
+  return best;
+}
+
+/*
+ * Ping all the neighbors of the router. With backoff enabled, a neighbor
+ * that was sent a link state or path vector packet during the last
+ * interval takes it as a keepalive, and is only pinged every
+ * detect_multiplier intervals (or when the interval changes), so that it
+ * still learns about us if it restarted.
+ */
+void ping_neighbors() {
+
+  Ping_packet p;
+  long int now = monotonic_time();
+
+  /* Say when to expect the next ones */
+  p.interval = adaptive.hello_interval;
+  p.detect_multiplier = router.detect_multiplier;
+
+  /* Set the other credentials */
+  p.sender_id = router.id;
+  p.sender_LS_port = router.myLSport;
+  p.sender_PV_port = router.myPVport;
+
+  /* Encode the packet once, it's the same for every neighbor */
+  hello_packet.length = encode_ping_packet(&p, hello_packet.data,
+                                           sizeof(hello_packet.data));
+
+  /* Ping each neighbor with the packet */
+  for(int i=0; i < router.num_neighbors; i++) {
+    Neighbor *neighbor = &router.neighbors[i];
+    if(adaptive.max_factor > 1 && neighbor->is_up == TRUE &&
+       neighbor->announced_interval == adaptive.hello_interval &&
+       now - neighbor->last_sent < adaptive.hello_interval &&
+       neighbor->hellos_skipped < router.detect_multiplier - 1) {
+      neighbor->hellos_skipped++;
+      adaptive.hellos_saved++;
+      continue;
+    }
+    neighbor->hellos_skipped = 0;
+    neighbor->announced_interval = adaptive.hello_interval;
+    send_packet(neighbor->port, hello_packet.data, hello_packet.length);
+  }
+}
+
+/*
+ * void
+ * send_path_vector_packets()
+ *
+ * Send all paired neighbors the changes to our path vectors. The paths are
+ * only compared again once the routes were recomputed, or while a peer
+ * still has to hear from us.
+ */
+void send_path_vector_packets() {
+  for(int i=0; i<router.num_neighbors; i++) {
+    Adj_rib_out *rib = &router.rib_out[i];
+    if(router.neighbors[i].is_paired == FALSE ||
+       (rib->is_synced == TRUE && rib->version == spf_throttle.num_runs))
+      continue;
+    send_pv_update(i);
+  }
+}
+
+/*
+ * void
+ * send_pv_update
+ *
+ * Sends peering session `i` our paths that are new or changed since the
+ * last ones it was sent, and withdraws those it was sent but shouldn't use
+ * anymore, packing as many as fit in each update. Paths that go through
+ * the peer are not offered to it. What was sent is recorded in its
+ * Adj-RIB-Out.
+ */
+void send_pv_update(int i) {
+  static Pv_packet p;
+  Neighbor *neighbor = &router.neighbors[i];
+  Adj_rib_out *rib = &router.rib_out[i];
+  int path[MAX_PATH], size = 0;
+
+  grow_array((void **)&rib->paths, &rib->max_paths, router.num_nodes,
+             sizeof(Path *));
+
+  memcpy(p.key, neighbor->key, sizeof(p.key));
+  p.sender_PV_port = router.myPVport;
+  p.flags = (rib->is_synced == TRUE) ? 0 : PV_REFRESH;
+  p.num_withdrawn = p.num_routes = 0;
+
+  for(int j=0; j<router.num_nodes; j++) {
+    Path *old = rib->paths[j];
+    int length = 0, needed;
+
+    /*
+     * Set the first element of the path to itself, so that we
+     * don't have to worry about processing it at the other end.
+     */
+    if(j != router.index) {
+      path[0] = router.id;
+      length = route_path(j, path + 1, MAX_PATH - 1) + 1;
+      if(length == 1 || length > MAX_PATH)
+        length = 0;
+      for(int k=1; k<length; k++)
+        if(path[k] == neighbor->id)
+          length = 0;
+    }
+
+    /* Nothing to say if the peer has it already */
+    if(old == NULL ? (length == 0) :
+       (old->length == length &&
+        memcmp(old->hops, path, length * sizeof(int)) == 0))
+      continue;
+
+    /* Start another update once this one is full */
+    needed = wire_varint_size(router.nodes[j].id);
+    if(length != 0) {
+      needed += wire_varint_size(length);
+      for(int k=0; k<length; k++)
+        needed += wire_varint_size(path[k]);
+    }
+    if(size + needed > RECV_BUFFER_SIZE - PV_UPDATE_OVERHEAD ||
+       p.num_routes == MAX_PV_ROUTES || p.num_withdrawn == MAX_PV_WITHDRAWN) {
+      flush_pv_update(i, &p);
+      size = 0;
+    }
+    size += needed;
+
+    release_path(old);
+    rib->paths[j] = NULL;
+    if(length == 0)
+      p.withdrawn[p.num_withdrawn++] = router.nodes[j].id;
+    else {
+      struct Path_vector *pv = &p.routes[p.num_routes++];
+      pv->dest = router.nodes[j].id;
+      pv->length = length;
+      memcpy(pv->path, path, length * sizeof(int));
+      rib->paths[j] = new_path(path, length);
+    }
+  }
+
+  if(p.num_withdrawn > 0 || p.num_routes > 0 || p.flags != 0)
+    flush_pv_update(i, &p);
+  rib->version = spf_throttle.num_runs;
+}
+
+/*
+ * void
+ * flush_pv_update
+ *
+ * Sends the update `p` to peering session `i`, and empties it.
+ */
+void flush_pv_update(int i, Pv_packet *p) {
+  char buff[RECV_BUFFER_SIZE];
+  int length = encode_pv_packet(p, buff, sizeof(buff));
+
+  if(length != FAILURE) {
+    send_packet_copy(router.neighbors[i].port, buff, length);
+    router.neighbors[i].last_sent = monotonic_time();
+  }
+  p->num_withdrawn = p->num_routes = 0;
+}
+
+/*
+ * void
+ * clear_adj_rib_out
+ *
+ * Forgets what peering session `i` was sent, so that the next update
+ * carries all of our paths.
+ */
+void clear_adj_rib_out(int i) {
+  Adj_rib_out *rib = &router.rib_out[i];
+
+  for(int j=0; j<rib->max_paths; j++) {
+    release_path(rib->paths[j]);
+    rib->paths[j] = NULL;
+  }
+}
+
+/*
+ * void
+ * encode_lsa
+ *
+ * Encodes the advertisement of node `origin` from the link state database
+ * into `packet`, as relayed by this router. No advertisement in the
+ * database has more than MAX_LSA_NEIGHBORS adjacencies (see originate_lsa()
+ * and decode_link_state_packet()), so they all fit.
+ */
+void encode_lsa(int origin, Encoded_packet *packet) {
+  Lsa *lsa = router.nodes[origin].lsa;
+  Link_state_packet p;
+
+  p.num_neighbors = lsa->num_links;
+  for(int i=0; i<p.num_neighbors; i++) {
+    p.neighbors[i].id = router.nodes[lsa->links[i].to].id;
+    p.neighbors[i].cost = lsa->links[i].cost;
+  }
+  p.sequence = lsa->sequence;
+  p.relayed_by = router.id;
+  p.sender_LS_port = (origin == router.index) ? router.myLSport : 0;
+  p.sender_id = router.nodes[origin].id;
+
+  packet->length = encode_link_state_packet(&p, packet->data,
+                                            sizeof(packet->data));
+}
+
+/*
+ * void
+ * send_lsa_to
+ *
+ * Sends the advertisement of node `origin` from the link state database
+ * to the neighbor(s) with ID `id`.
+ */
+void send_lsa_to(int origin, int id) {
+  Encoded_packet packet;
+
+  encode_lsa(origin, &packet);
+  for(int i=0; i<router.num_neighbors; i++)
+    if(router.neighbors[i].id == id) {
+      send_packet_copy(router.neighbors[i].port, packet.data, packet.length);
+      router.neighbors[i].last_sent = monotonic_time();
+    }
+}
+
+/*
+ * void
+ * originate_lsa
+ *
+ * Advertises the neighbors that are up (see process_ping_packet()), if
+ * they changed since the last advertisement, or if `force`
+ * is set (for the periodic refresh). A neighbor that just came up is sent
+ * the whole database first, so that it doesn't have to wait for the
+ * refreshes to learn about the rest of the network. Only the first
+ * MAX_LSA_NEIGHBORS neighbors fit in the advertisement; the links to the
+ * others are left out, here and everywhere else, and reported each time.
+ */
+void originate_lsa(int force) {
+  Lsa *old = router.nodes[router.index].lsa, *lsa;
+  int is_changed = FALSE, num_left_out = 0;
+  long int now = monotonic_time();
+
+  lsa = malloc(sizeof(Lsa) + router.num_neighbors * sizeof(Link));
+  if(lsa == NULL) {
+    perror("originate_lsa: malloc");
+    exit(1);
+  }
+  lsa->num_links = 0;
+
+  /* The first entry for a neighbor gives the cost of the link to it */
+  for(int i=0; i<router.num_neighbors; i++) {
+    Neighbor *neighbor = &router.neighbors[i];
+    if(neighbor->id == UNSET || neighbor->is_up == FALSE)
+      continue;
+    int index = add_node(neighbor->id);
+    if(index == UNSET || lsa_find_link(lsa, index) != NULL)
+      continue;
+    if(lsa->num_links == MAX_LSA_NEIGHBORS) {
+      num_left_out++;
+      continue;
+    }
+    Link *link = &lsa->links[lsa->num_links++];
+    link->to = index;
+    link->cost = neighbor->cost;
+    link->last_seen = now;
+  }
+
+  /* Compare with the last advertisement */
+  if(old == NULL || old->num_links != lsa->num_links)
+    is_changed = TRUE;
+  for(int i=0; i<lsa->num_links && is_changed == FALSE; i++) {
+    Link *link = lsa_find_link(old, lsa->links[i].to);
+    if(link == NULL || link->cost != lsa->links[i].cost)
+      is_changed = TRUE;
+  }
+  if(is_changed == FALSE && force == FALSE) {
+    free(lsa);
+    return;
+  }
+  if(num_left_out > 0)
+    printf("Too many neighbors up: %d of them left out of the link state "
+           "advertisement, which holds %d.\n\n", num_left_out,
+           MAX_LSA_NEIGHBORS);
+
+  /* Routes that override the one to a lost neighbor go away */
+  for(int i=0; old != NULL && i<old->num_links; i++) {
+    int to = old->links[i].to;
+    if(lsa_find_link(lsa, to) == NULL && router.nodes[to].path != NULL)
+      set_path(to, NULL);
+  }
+
+  /* Bring new neighbors up to date */
+  for(int i=0; i<lsa->num_links; i++) {
+    if(lsa_find_link(old, lsa->links[i].to) != NULL)
+      continue;
+    for(int j=0; j<router.num_nodes; j++)
+      if(j != router.index && router.nodes[j].lsa != NULL)
+        send_lsa_to(j, router.nodes[lsa->links[i].to].id);
+  }
+
+  lsa->sequence = ++router.lsa_sequence;
+  install_lsa(router.index, lsa);
+
+  /* Encode the packet once, it's the same for every neighbor */
+  encode_lsa(router.index, &lsa_packet);
+  for(int i=0; i<router.num_neighbors; i++) {
+    if(router.neighbors[i].is_paired == FALSE) {
+      send_packet(router.neighbors[i].port, lsa_packet.data, lsa_packet.length);
+      router.neighbors[i].last_sent = monotonic_time();
+    }
+  }
+}
+
+/*
+ * void
+ * grow_spf_state
+ *
+ * Makes sure the arrays in `spf` have an entry for every node. Nodes that
+ * were added since the last computation start out unreachable.
+ */
+void grow_spf_state() {
+  int old_max = spf.max_nodes, max_nodes;
+
+  if(router.num_nodes > old_max) {
+    /* All the arrays grow together, track their size in one counter */
+    int **arrays[] = { &spf.dist, &spf.previous, &spf.next_hop,
+                       &spf.next_hop_mark, &spf.heap, &spf.heap_pos,
+                       &spf.subtree, &spf.subtree_mark, &spf.touch_mark,
+                       &spf.touched, &spf.order, &spf.affected,
+                       &spf.affected_mark, &spf.source_mark };
+    for(int i=0; i<(int)(sizeof(arrays) / sizeof(arrays[0])); i++) {
+      max_nodes = old_max;
+      grow_array((void **)arrays[i], &max_nodes, router.num_nodes, sizeof(int));
+    }
+    spf.max_nodes = max_nodes;
+  }
+  grow_array((void **)&spf.ecmp, &spf.max_ecmp,
+             router.num_nodes * MAX_ECMP_PATHS, sizeof(int));
+
+  for(int i=spf.num_nodes; i<router.num_nodes; i++) {
+    spf.dist[i] = MAX_INT;
+    spf.previous[i] = UNSET;
+    spf.next_hop[i] = UNSET;
+    spf.next_hop_mark[i] = spf.next_hop_generation;
+    spf.heap_pos[i] = UNSET;
+    reset_ecmp(i);
+  }
+  spf.num_nodes = router.num_nodes;
+}
+
+/*
+ * void
+ * heap_sift_up
+ *
+ * Moves the node at position `i` of the heap up until its parent is no
+ * further than it.
+ */
+void heap_sift_up(int i) {
+  int node = spf.heap[i];
+
+  while(i > 0) {
+    int parent = (i - 1) / 2;
+    if(spf.heap_dist[spf.heap[parent]] <= spf.heap_dist[node])
+      break;
+    spf.heap[i] = spf.heap[parent];
+    spf.heap_pos[spf.heap[i]] = i;
+    i = parent;
+  }
+  spf.heap[i] = node;
+  spf.heap_pos[node] = i;
+}
+
+/*
+ * void
+ * heap_sift_down
+ *
+ * Moves the node at position `i` of the heap down until both its children
+ * are at least as far as it.
+ */
+void heap_sift_down(int i) {
+  int node = spf.heap[i];
+
+  while(1) {
+    int child = 2 * i + 1;
+    if(child >= spf.heap_size)
+      break;
+    if(child + 1 < spf.heap_size &&
+       spf.heap_dist[spf.heap[child + 1]] < spf.heap_dist[spf.heap[child]])
+      child++;
+    if(spf.heap_dist[node] <= spf.heap_dist[spf.heap[child]])
+      break;
+    spf.heap[i] = spf.heap[child];
+    spf.heap_pos[spf.heap[i]] = i;
+    i = child;
+  }
+  spf.heap[i] = node;
+  spf.heap_pos[node] = i;
+}
+
+/*
+ * void
+ * heap_update
+ *
+ * Inserts `node` in the heap, or moves it up after its distance has
+ * decreased.
+ */
+void heap_update(int node) {
+  if(spf.heap_pos[node] == UNSET) {
+    spf.heap[spf.heap_size] = node;
+    spf.heap_pos[node] = spf.heap_size++;
+  }
+  heap_sift_up(spf.heap_pos[node]);
+}
+
+/*
+ * int
+ * heap_pop
+ *
+ * Removes and returns the closest node in the heap.
+ */
+int heap_pop() {
+  int node = spf.heap[0];
+
+  spf.heap_pos[node] = UNSET;
+  if(--spf.heap_size > 0) {
+    spf.heap[0] = spf.heap[spf.heap_size];
+    heap_sift_down(0);
+  }
+  return node;
+}
+
+/*
+ * void
+ * spf_heap
+ *
+ * SPF engine for arbitrary link costs: Dijkstra's algorithm with a binary
+ * heap, in O((N + E) log N).
+ */
+void spf_heap(int start) {
+  spf.heap_size = 0;
+  for(int i=0; i<router.num_nodes; i++)
+    spf.heap_pos[i] = UNSET;
+
+  spf.dist[start] = 0;
+  heap_update(start);
+
+  while(spf.heap_size > 0) {
+    int curr = heap_pop();
+    Node *node = &router.nodes[curr];
+
+    /* 
+     * For each of the neighbors of current node, check if the new path is
+     * cheaper than the old one, if so update the distance 
+     */ 
+    for(int j=0; j<node->num_links; j++) {
+      int i = node->links[j].to;
+      int new_dist = spf.dist[curr] + node->links[j].cost;
+      if(new_dist < spf.dist[i]) {
+        spf.dist[i] = new_dist;
+        spf.previous[i] = curr;
+        heap_update(i);
+      }
+    }
+  }
+}
+
+/*
+ * void
+ * spf_distances
+ *
+ * Computes the distances from node `start` to every node into `dist`, or
+ * from every node to `start` if `is_reverse` is set, without touching the
+ * shortest path tree. Borrows the heap, which is empty between runs.
+ */
+void spf_distances(int start, int *dist, int is_reverse) {
+  for(int i=0; i<router.num_nodes; i++)
+    dist[i] = MAX_INT;
+  spf.heap_dist = dist;
+  spf.heap_size = 0;
+
+  dist[start] = 0;
+  heap_update(start);
+
+  while(spf.heap_size > 0) {
+    int curr = heap_pop();
+    Node *node = &router.nodes[curr];
+
+    for(int j=0; j<node->num_links; j++) {
+      int i = node->links[j].to, cost = node->links[j].cost;
+      if(is_reverse == TRUE) {
+        Link *link = find_link(i, curr);
+        if(link == NULL)
+          continue;
+        cost = link->cost;
+      }
+      if(dist[curr] + cost < dist[i]) {
+        dist[i] = dist[curr] + cost;
+        heap_update(i);
+      }
+    }
+  }
+
+  spf.heap_dist = spf.dist;
+}
+
+/*
+ * void
+ * spf_bfs
+ *
+ * SPF engine for when every link has the same cost: a breadth-first
+ * search, in O(N + E). spf.heap is used as the queue.
+ */
+void spf_bfs(int start) {
+  int head = 0, tail = 0;
+  int cost = spf.uniform_cost;
+
+  spf.dist[start] = 0;
+  spf.heap[tail++] = start;
+
+  while(head < tail) {
+    int curr = spf.heap[head++];
+    Node *node = &router.nodes[curr];
+
+    for(int j=0; j<node->num_links; j++) {
+      int i = node->links[j].to;
+      if(spf.dist[i] == MAX_INT) {
+        spf.dist[i] = spf.dist[curr] + cost;
+        spf.previous[i] = curr;
+        spf.heap[tail++] = i;
+      }
+    }
+  }
+}
+
+/*
+ * void
+ * spf_bitset
+ *
+ * SPF engine for small topologies where every link has the same cost: a
+ * breadth-first search over the adjacency bitmap, one whole level at a
+ * time. The next frontier is the OR of the rows of the current one, minus
+ * the nodes already visited, so each level costs a few word operations
+ * per frontier node instead of a branch per link.
+ */
+void spf_bitset(int start) {
+  int words, dist = 0;
+
+  if(bitmap.is_stale == TRUE)
+    bitmap_rebuild();
+  words = bitmap.words;
+
+  memset(bitmap.visited, 0, words * sizeof(uint64_t));
+  memset(bitmap.frontier, 0, words * sizeof(uint64_t));
+  bitmap.visited[start / 64] = bitmap.frontier[start / 64] =
+    (uint64_t)1 << (start % 64);
+  spf.dist[start] = 0;
+
+  while(1) {
+    int count = 0;
+    dist += spf.uniform_cost;
+
+    /* Everything adjacent to the frontier, that wasn't visited yet */
+    memset(bitmap.next, 0, words * sizeof(uint64_t));
+    for(int w=0; w<words; w++) {
+      uint64_t bits = bitmap.frontier[w];
+      while(bits) {
+        int u = w * 64 + __builtin_ctzll(bits);
+        uint64_t *row = &bitmap.rows[(size_t)u * words];
+        for(int k=0; k<words; k++)
+          bitmap.next[k] |= row[k];
+        bits &= bits - 1;
+      }
+    }
+    for(int w=0; w<words; w++) {
+      bitmap.next[w] &= ~bitmap.visited[w];
+      count += __builtin_popcountll(bitmap.next[w]);
+    }
+    if(count == 0)
+      break;
+
+    /* 
+     * Settle the new level. The previous hop of a node is the first node
+     * of the frontier it is linked to; links are symmetric, so that's the
+     * first bit of its own row that is in the frontier.
+     */
+    for(int w=0; w<words; w++) {
+      uint64_t bits = bitmap.next[w];
+      while(bits) {
+        int v = w * 64 + __builtin_ctzll(bits);
+        uint64_t *row = &bitmap.rows[(size_t)v * words];
+        for(int k=0; k<words; k++) {
+          uint64_t parents = row[k] & bitmap.frontier[k];
+          if(parents) {
+            spf.previous[v] = k * 64 + __builtin_ctzll(parents);
+            break;
+          }
+        }
+        spf.dist[v] = dist;
+        bits &= bits - 1;
+      }
+      bitmap.visited[w] |= bitmap.next[w];
+    }
+
+    /* The new level becomes the frontier */
+    uint64_t *frontier = bitmap.frontier;
+    bitmap.frontier = bitmap.next;
+    bitmap.next = frontier;
+  }
+}
+
+/*
+ * Spf_engine
+ * select_spf_engine
+ *
+ * Picks the cheapest engine that is correct for the current topology: if
+ * all links cost the same, a breadth-first search (over the adjacency
+ * bitmap if the topology is small enough), the heap otherwise.
+ */
+Spf_engine select_spf_engine() {
+  int cost = UNSET;
+
+  for(int i=0; i<router.num_nodes; i++) {
+    Node *node = &router.nodes[i];
+    for(int j=0; j<node->num_links; j++) {
+      if(cost == UNSET)
+        cost = node->links[j].cost;
+      else if(node->links[j].cost != cost)
+        return spf_heap;
+    }
+  }
+
+  spf.uniform_cost = (cost == UNSET) ? DEFAULT_LINK_COST : cost;
+  if(router.num_nodes <= MAX_BITMAP_NODES)
+    return spf_bitset;
+  return spf_bfs;
+}
+
+/*
+ * void
+ * touch_node
+ *
+ * Remembers that the path to `node` changed during the current repair.
+ */
+void touch_node(int node) {
+  if(spf.touch_mark[node] != spf.generation) {
+    spf.touch_mark[node] = spf.generation;
+    spf.touched[spf.num_touched++] = node;
+  }
+}
+
+/*
+ * void
+ * spf_propagate
+ *
+ * Runs Dijkstra's algorithm from the nodes currently in the heap, whose
+ * distances just decreased, until no distance can be improved anymore.
+ * Only the nodes whose distance decreases are visited.
+ */
+void spf_propagate() {
+  while(spf.heap_size > 0) {
+    int curr = heap_pop();
+    Node *node = &router.nodes[curr];
+
+    for(int j=0; j<node->num_links; j++) {
+      int i = node->links[j].to;
+      int new_dist = spf.dist[curr] + node->links[j].cost;
+      if(new_dist < spf.dist[i]) {
+        spf.dist[i] = new_dist;
+        spf.previous[i] = curr;
+        heap_update(i);
+        touch_node(i);
+      }
+    }
+  }
+}
+
+/*
+ * void
+ * spf_repair_subtree
+ *
+ * The link into `top` in the shortest path tree went away or got more
+ * expensive. Detaches the subtree below `top`, reattaches each of its
+ * nodes through the cheapest link from the rest of the tree, and lets
+ * spf_propagate() settle the subtree from there.
+ */
+void spf_repair_subtree(int top) {
+  int count = 0, next = 0;
+
+  /* Collect the subtree: the children of a node are among its links */
+  spf.subtree[count++] = top;
+  spf.subtree_mark[top] = spf.generation;
+  while(next < count) {
+    int curr = spf.subtree[next++];
+    Node *node = &router.nodes[curr];
+    for(int j=0; j<node->num_links; j++) {
+      int child = node->links[j].to;
+      if(spf.previous[child] == curr &&
+         spf.subtree_mark[child] != spf.generation) {
+        spf.subtree_mark[child] = spf.generation;
+        spf.subtree[count++] = child;
+      }
+    }
+  }
+  for(int i=0; i<count; i++) {
+    int curr = spf.subtree[i];
+    spf.dist[curr] = MAX_INT;
+    spf.previous[curr] = UNSET;
+    touch_node(curr);
+  }
+
+  /* Reattach every node through its cheapest link from outside */
+  for(int i=0; i<count; i++) {
+    int curr = spf.subtree[i];
+    Node *node = &router.nodes[curr];
+    for(int j=0; j<node->num_links; j++) {
+      int from = node->links[j].to;
+      Link *link;
+      if(spf.subtree_mark[from] == spf.generation ||
+         spf.dist[from] == MAX_INT ||
+         (link = find_link(from, curr)) == NULL)
+        continue;
+      if(spf.dist[from] + link->cost < spf.dist[curr]) {
+        spf.dist[curr] = spf.dist[from] + link->cost;
+        spf.previous[curr] = from;
+      }
+    }
+    if(spf.dist[curr] != MAX_INT)
+      heap_update(curr);
+  }
+
+  spf_propagate();
+}
+
+/*
+ * void
+ * spf_incremental
+ *
+ * Brings the shortest path tree up to date with the pending link changes,
+ * repairing only the parts of it they affect. Links that got worse are
+ * handled first, so that improvements propagate from correct distances.
+ * The nodes whose path changed are left in spf.touched.
+ */
+void spf_incremental() {
+  spf.generation++;
+  spf.num_touched = 0;
+  spf.heap_size = 0;
+
+  /* Links of the tree that went away, or got more expensive */
+  for(int i=0; i<spf.num_changes; i++) {
+    int ends[2] = { spf.changes[i].a, spf.changes[i].b };
+    for(int j=0; j<2; j++) {
+      int u = ends[j], v = ends[1 - j];
+      Link *link = find_link(u, v);
+      if(spf.previous[v] == u &&
+         (link == NULL || spf.dist[u] + link->cost > spf.dist[v])) {
+        /* Each repair needs its own subtree marks */
+        spf_repair_subtree(v);
+        spf.generation++;
+        for(int k=0; k<spf.num_touched; k++)
+          spf.touch_mark[spf.touched[k]] = spf.generation;
+      }
+    }
+  }
+
+  /* Links that are new, or got cheaper */
+  for(int i=0; i<spf.num_changes; i++) {
+    int ends[2] = { spf.changes[i].a, spf.changes[i].b };
+    for(int j=0; j<2; j++) {
+      int u = ends[j], v = ends[1 - j];
+      Link *link = find_link(u, v);
+      if(link != NULL && spf.dist[u] != MAX_INT &&
+         spf.dist[u] + link->cost < spf.dist[v]) {
+        spf.dist[v] = spf.dist[u] + link->cost;
+        spf.previous[v] = u;
+        heap_update(v);
+        touch_node(v);
+        spf_propagate();
+      }
+    }
+  }
+}
+
+/*
+ * void
+ * resolve_next_hop
+ *
+ * Makes sure spf.next_hop is up to date for node `i` of the shortest path
+ * tree rooted at `start`. The branch above `i` is walked up to the first
+ * node that is resolved already, and resolved on the way back down, so
+ * each node is only visited once per computation. spf.subtree is used as
+ * the stack.
+ */
+void resolve_next_hop(int i, int start) {
+  int count = 0, next_hop;
+
+  while(spf.next_hop_mark[i] != spf.next_hop_generation) {
+    if(i == start || spf.dist[i] == MAX_INT) {
+      spf.next_hop[i] = UNSET;
+      spf.next_hop_mark[i] = spf.next_hop_generation;
+      break;
+    }
+    spf.subtree[count++] = i;
+    i = spf.previous[i];
+  }
+
+  while(count > 0) {
+    int node = spf.subtree[--count];
+    next_hop = (spf.previous[node] == start) ? node :
+               spf.next_hop[spf.previous[node]];
+    spf.next_hop[node] = next_hop;
+    spf.next_hop_mark[node] = spf.next_hop_generation;
+  }
+}
+
+/*
+ * Comparison function for qsort(), to order nodes by their distance in the
+ * shortest path tree.
+ */
+int compare_distances(const void *a, const void *b) {
+  int x = spf.dist[*(const int *)a], y = spf.dist[*(const int *)b];
+  return (x > y) - (x < y);
+}
+
+/*
+ * void
+ * reset_ecmp
+ *
+ * Leaves node `i` with only its next hop in the tree, if any, as an equal
+ * cost next hop.
+ */
+void reset_ecmp(int i) {
+  int *ecmp = spf.ecmp + (size_t)i * MAX_ECMP_PATHS;
+
+  for(int k=0; k<MAX_ECMP_PATHS; k++)
+    ecmp[k] = UNSET;
+  ecmp[0] = spf.next_hop[i];
+}
+
+/*
+ * void
+ * push_ecmp
+ *
+ * Adds the equal cost next hops of node `u` to those of the nodes it is a
+ * predecessor of on a shortest path from `start`: the nodes linked to it
+ * whose distance is its own plus the cost of the link. If `only_affected`
+ * is set, only to those in spf.affected.
+ */
+void push_ecmp(int u, int start, int only_affected) {
+  Node *node = &router.nodes[u];
+
+  for(int j=0; j<node->num_links; j++) {
+    int v = node->links[j].to;
+    if(v == start || spf.dist[v] == MAX_INT ||
+       (long int)spf.dist[u] + node->links[j].cost != spf.dist[v])
+      continue;
+    if(only_affected == TRUE && spf.affected_mark[v] != spf.generation)
+      continue;
+
+    /* A neighbor of the root is its own next hop */
+    int *from = (u == start) ? &v : spf.ecmp + (size_t)u * MAX_ECMP_PATHS;
+    int num_from = (u == start) ? 1 : MAX_ECMP_PATHS;
+    int *to = spf.ecmp + (size_t)v * MAX_ECMP_PATHS;
+    for(int k=0; k<num_from && from[k] != UNSET; k++) {
+      int m = 0;
+      while(m < MAX_ECMP_PATHS && to[m] != UNSET && to[m] != from[k])
+        m++;
+      if(m < MAX_ECMP_PATHS && to[m] == UNSET)
+        to[m] = from[k];
+    }
+  }
+}
+
+/*
+ * void
+ * resolve_ecmp
+ *
+ * Collects the equal cost next hops of every node reachable from `start`
+ * into spf.ecmp: the next hops of all its predecessors on a shortest path,
+ * that is every node linked to it whose distance plus the cost of the link
+ * is its own. They are found from the distances, whichever engine computed
+ * those, going through the nodes by increasing distance: costs are
+ * positive, so the predecessors of a node are complete by the time it is
+ * reached. The next hop in the tree always comes first.
+ */
+void resolve_ecmp(int start) {
+  int count = 0;
+
+  for(int i=0; i<router.num_nodes; i++) {
+    reset_ecmp(i);
+    if(spf.dist[i] != MAX_INT)
+      spf.order[count++] = i;
+  }
+  qsort(spf.order, count, sizeof(int), compare_distances);
+
+  for(int n=0; n<count; n++)
+    push_ecmp(spf.order[n], start, FALSE);
+}
+
+/*
+ * void
+ * mark_ecmp_affected
+ *
+ * Adds `node` to the nodes whose equal cost next hops are resolved again.
+ */
+void mark_ecmp_affected(int node) {
+  if(spf.affected_mark[node] != spf.generation) {
+    spf.affected_mark[node] = spf.generation;
+    spf.affected[spf.num_affected++] = node;
+  }
+}
+
+/*
+ * void
+ * resolve_touched_ecmp
+ *
+ * Same as resolve_ecmp(), after a repair of the tree, for only the nodes
+ * whose equal cost next hops may have changed: those whose path changed,
+ * their neighbors, which may have gained or lost them as predecessors,
+ * the ends of the links that changed, and everything downstream of those
+ * on a shortest path. Their predecessors are the only other nodes that
+ * have to be gone through.
+ */
+void resolve_touched_ecmp(int start) {
+  int count = 0;
+
+  spf.generation++;
+  spf.num_affected = 0;
+  for(int i=0; i<spf.num_touched; i++) {
+    Node *node = &router.nodes[spf.touched[i]];
+    mark_ecmp_affected(spf.touched[i]);
+    for(int j=0; j<node->num_links; j++)
+      mark_ecmp_affected(node->links[j].to);
+  }
+  for(int i=0; i<spf.num_changes; i++) {
+    mark_ecmp_affected(spf.changes[i].a);
+    mark_ecmp_affected(spf.changes[i].b);
+  }
+
+  /* Everything downstream, the list grows as it is gone through */
+  for(int n=0; n<spf.num_affected; n++) {
+    int u = spf.affected[n];
+    Node *node = &router.nodes[u];
+    if(spf.dist[u] == MAX_INT)
+      continue;
+    for(int j=0; j<node->num_links; j++) {
+      int v = node->links[j].to;
+      if(spf.dist[v] != MAX_INT &&
+         (long int)spf.dist[u] + node->links[j].cost == spf.dist[v])
+        mark_ecmp_affected(v);
+    }
+  }
+
+  /* The predecessors of those are the neighbors they are linked to */
+  for(int n=0; n<spf.num_affected; n++) {
+    int v = spf.affected[n];
+    Node *node = &router.nodes[v];
+    reset_ecmp(v);
+    if(spf.dist[v] == MAX_INT)
+      continue;
+    for(int j=0; j<node->num_links; j++) {
+      int u = node->links[j].to;
+      if(spf.dist[u] != MAX_INT && spf.source_mark[u] != spf.generation) {
+        spf.source_mark[u] = spf.generation;
+        spf.order[count++] = u;
+      }
+    }
+  }
+  qsort(spf.order, count, sizeof(int), compare_distances);
+
+  for(int n=0; n<count; n++)
+    push_ecmp(spf.order[n], start, TRUE);
+}
+
+/*
+ * int
+ * dijkstra
+ *
+ * Computes the shortest path tree from `init`, which is the routing table
+ * for the destinations that have no path overriding it. If the last tree
+ * is still good apart from a few link changes, only the affected part of
+ * it is repaired and only the next hops that changed are resolved again;
+ * otherwise the SPF engine that suits the topology recomputes everything.
+ */
+int dijkstra(int init) {
+
+  int start = lookup_node(init);
+
+  if(start == UNSET)
+    return FAILURE;
+
+  grow_spf_state();
+  spf.heap_dist = spf.dist;
+
+  if(spf.is_valid == TRUE && spf.root == start) {
+    spf_incremental();
+    /*
+     * The descendants of a node whose path changed were touched as well,
+     * so the rest of the tree keeps its next hops.
+     */
+    for(int i=0; i<spf.num_touched; i++)
+      spf.next_hop_mark[spf.touched[i]] = spf.next_hop_generation - 1;
+    for(int i=0; i<spf.num_touched; i++)
+      resolve_next_hop(spf.touched[i], start);
+    resolve_touched_ecmp(start);
+  }
+  else {
+    /* set all the distances to MAX_INT, the engine fills them in */
+    for(int i=0; i<router.num_nodes; i++) {
+      spf.dist[i] = MAX_INT;
+      spf.previous[i] = UNSET;
+    }
+
+    select_spf_engine()(start);
+
+    /* Every node has to be resolved again */
+    spf.next_hop_generation++;
+    for(int i=0; i<router.num_nodes; i++)
+      resolve_next_hop(i, start);
+
+    resolve_ecmp(start);
+
+    spf.root = start;
+    spf.is_valid = TRUE;
+  }
+
+  spf.num_changes = 0;
+  return SUCCESS;
+}
+
+/*
+ * void
+ * invalidate_fib
+ *
+ * Marks the forwarding table as out of date. Called whenever a path or a
+ * policy changes; those don't affect the shortest path tree, which keeps
+ * its own record of the link changes.
+ */
+void invalidate_fib() {
+  fib.is_dirty = TRUE;
+  fib.num_changes++;
+}
+
+/*
+ * int
+ * route_next_hop
+ *
+ * Returns the index of the next hop on the route to node `index`, or UNSET
+ * if it is unreachable. Only valid after dijkstra().
+ */
+int route_next_hop(int index) {
+  Node *node = &router.nodes[index];
+
+  if(node->is_preferred == TRUE || node->uses_path_vector == TRUE)
+    return (node->path == NULL) ? UNSET : lookup_node(node->path->hops[0]);
+  /* Nodes added since the last computation aren't in the tree yet */
+  if(index >= spf.num_nodes)
+    return UNSET;
+  return spf.next_hop[index];
+}
+
+/*
+ * int
+ * route_length
+ *
+ * Returns the number of hops on the route to node `index`, 0 if it is
+ * unreachable. Only valid after dijkstra().
+ */
+int route_length(int index) {
+  Node *node = &router.nodes[index];
+  int length = 0;
+
+  if(node->is_preferred == TRUE || node->uses_path_vector == TRUE)
+    return (node->path == NULL) ? 0 : node->path->length;
+  if(index >= spf.num_nodes || spf.next_hop[index] == UNSET)
+    return 0;
+  for(int i=index; i != spf.root; i = spf.previous[i])
+    length++;
+  return length;
+}
+
+/*
+ * int
+ * route_path
+ *
+ * Writes the IDs of the routers on the route to node `index`, ending with
+ * its own, into `hops`, and returns their number. Only the first `max` are
+ * written if there are more. Only valid after dijkstra().
+ */
+int route_path(int index, int *hops, int max) {
+  Node *node = &router.nodes[index];
+  int length = route_length(index);
+
+  if(node->is_preferred == TRUE || node->uses_path_vector == TRUE) {
+    for(int i=0; i<length && i<max; i++)
+      hops[i] = node->path->hops[i];
+    return length;
+  }
+
+  /* The tree is walked from the destination back up to this router */
+  int i = index;
+  for(int k=length - 1; k>=0; k--) {
+    if(k < max)
+      hops[k] = router.nodes[i].id;
+    i = spf.previous[i];
+  }
+  return length;
+}
+
+/*
+ * void
+ * record_link_change
+ *
+ * Marks the forwarding table as out of date after the link between nodes
+ * `a` and `b` came up, went down or changed cost. The change is queued so
+ * that the shortest path tree can be repaired incrementally, unless too
+ * many changes piled up.
+ */
+void record_link_change(int a, int b) {
+  fib.is_dirty = TRUE;
+  fib.num_changes++;
+  flood_tree.is_dirty = TRUE;
+  lfa.is_dirty = TRUE;
+
+  if(spf.num_changes == MAX_INCREMENTAL_CHANGES) {
+    spf.is_valid = FALSE;
+    return;
+  }
+  spf.changes[spf.num_changes].a = a;
+  spf.changes[spf.num_changes].b = b;
+  spf.num_changes++;
+}
+
+/*
+ * int
+ * compare_flood_edges
+ *
+ * Orders flooding tree candidates by cost, then by the IDs of their ends.
+ * Node indices differ from router to router, IDs don't.
+ */
+int compare_flood_edges(const void *a, const void *b) {
+  const Flood_edge *x = a, *y = b;
+
+  if(x->cost != y->cost)
+    return (x->cost < y->cost) ? -1 : 1;
+  if(x->a != y->a)
+    return (router.nodes[x->a].id < router.nodes[y->a].id) ? -1 : 1;
+  if(x->b != y->b)
+    return (router.nodes[x->b].id < router.nodes[y->b].id) ? -1 : 1;
+  return 0;
+}
+
+/*
+ * int
+ * flood_tree_find
+ *
+ * Returns the root of the set `node` is in, in the union-find forest of
+ * the flooding tree computation, halving the path on the way.
+ */
+int flood_tree_find(int node) {
+  int *parent = flood_tree.parent;
+
+  while(parent[node] != node) {
+    parent[node] = parent[parent[node]];
+    node = parent[node];
+  }
+  return node;
+}
+
+/*
+ * void
+ * update_flood_tree
+ *
+ * Recomputes the flooding tree if the topology changed since it was last
+ * computed (Kruskal's algorithm over the adjacency lists).
+ */
+void update_flood_tree() {
+  int num_edges = 0, max_nodes;
+
+  if(flood_tree.is_dirty == FALSE)
+    return;
+
+  max_nodes = flood_tree.max_nodes;
+  grow_array((void **)&flood_tree.is_tree_neighbor, &max_nodes,
+             router.num_nodes, sizeof(int));
+  max_nodes = flood_tree.max_nodes;
+  grow_array((void **)&flood_tree.parent, &max_nodes,
+             router.num_nodes, sizeof(int));
+  flood_tree.max_nodes = max_nodes;
+
+  /* Every link is in both adjacency lists, take it from its lower end */
+  for(int i=0; i<router.num_nodes; i++) {
+    Node *node = &router.nodes[i];
+    for(int j=0; j<node->num_links; j++) {
+      int to = node->links[j].to;
+      if(node->id > router.nodes[to].id)
+        continue;
+
+      Link *reverse = find_link(to, i);
+      grow_array((void **)&flood_tree.edges, &flood_tree.max_edges,
+                 num_edges + 1, sizeof(Flood_edge));
+      Flood_edge *edge = &flood_tree.edges[num_edges++];
+      edge->a = i;
+      edge->b = to;
+      edge->cost = node->links[j].cost;
+      if(reverse != NULL && reverse->cost > edge->cost)
+        edge->cost = reverse->cost;
+    }
+  }
+  qsort(flood_tree.edges, num_edges, sizeof(Flood_edge), compare_flood_edges);
+
+  memset(flood_tree.is_tree_neighbor, 0,
+         (size_t)flood_tree.max_nodes * sizeof(int));
+  for(int i=0; i<router.num_nodes; i++)
+    flood_tree.parent[i] = i;
+
+  for(int i=0; i<num_edges; i++) {
+    Flood_edge *edge = &flood_tree.edges[i];
+    int root_a = flood_tree_find(edge->a), root_b = flood_tree_find(edge->b);
+
+    if(root_a == root_b)
+      continue;
+    flood_tree.parent[root_a] = root_b;
+    if(edge->a == router.index)
+      flood_tree.is_tree_neighbor[edge->b] = TRUE;
+    else if(edge->b == router.index)
+      flood_tree.is_tree_neighbor[edge->a] = TRUE;
+  }
+
+  flood_tree.is_dirty = FALSE;
+}
+
+/*
+ * void
+ * retire_fib_table
+ *
+ * Frees `table`, which is no longer published, as soon as the forwarding
+ * thread can't be using it anymore. If the forwarding thread is waiting
+ * for packets, it will load the new table when it wakes up, so the old one
+ * can go right away. Otherwise it is kept until the forwarding thread's
+ * epoch moves on, which it does before waiting again.
+ */
+void retire_fib_table(Fib_table *table) {
+  table->retired_epoch = __atomic_load_n(&forwarding_epoch, __ATOMIC_SEQ_CST);
+  if(table->retired_epoch % 2 == 0) {
+    free_fib_table(table);
+    return;
+  }
+  table->next_retired = fib.retired;
+  fib.retired = table;
+}
+
+/*
+ * void
+ * reclaim_fib_tables
+ *
+ * Frees the retired forwarding tables that the forwarding thread has
+ * stopped using.
+ */
+void reclaim_fib_tables() {
+  unsigned long epoch = __atomic_load_n(&forwarding_epoch, __ATOMIC_SEQ_CST);
+  Fib_table **prev = &fib.retired;
+
+  while(*prev != NULL) {
+    Fib_table *table = *prev;
+    if(table->retired_epoch != epoch) {
+      *prev = table->next_retired;
+      free_fib_table(table);
+    }
+    else
+      prev = &table->next_retired;
+  }
+}
+
+/*
+ * void
+ * free_fib_table
+ *
+ * Frees `table`, along with its index if no other table uses it.
+ */
+void free_fib_table(Fib_table *table) {
+  release_fib_index(table->index);
+  free(table);
+}
+
+/*
+ * Fib_index *
+ * hold_fib_index
+ *
+ * Returns a reference to the index of the tables built for the current
+ * nodes: the one of the last table if no node was added since, a copy of
+ * the ID-to-index map otherwise. It has to be given back with
+ * release_fib_index().
+ */
+Fib_index *hold_fib_index() {
+  Fib_index *index = fib.index;
+
+  if(index == NULL || index->num_nodes != router.num_nodes) {
+    index = malloc(sizeof(Fib_index) + router.max_node_id * sizeof(int));
+    if(index == NULL) {
+      perror("hold_fib_index: malloc");
+      exit(1);
+    }
+    index->refs = 1;
+    index->num_nodes = router.num_nodes;
+    index->max_node_id = router.max_node_id;
+    memcpy(index->slots, router.node_index, router.max_node_id * sizeof(int));
+    if(fib.index != NULL)
+      release_fib_index(fib.index);
+    fib.index = index;
+  }
+
+  index->refs++;
+  return index;
+}
+
+/*
  * void
- * set_prefer_policy
+ * release_fib_index
  *
- * Takes a string of the form "P <num_stops> <stop1> <stop2> ..."
- * and updates the routing table accordingly.
+ * Gives back a reference to `index`, freeing it if it was the last one.
+ * Only the control thread holds references.
  */
-void set_prefer_policy(char buff[80]) {
-  char *token = strtok(buff, " ");
-  token = strtok(NULL, " ");
-  int path_length = atoi(token);
-  int path[path_length];
-  token = strtok(NULL, " ");
-  int i=0;
-  while(token != NULL)
-  {
-    path[i] = atoi(token);
-    token = strtok(NULL, " ");
-    i++;
+void release_fib_index(Fib_index *index) {
+  if(--index->refs == 0)
+    free(index);
+}
+
+/*
+ * Fib_table *
+ * build_fib_table
+ *
+ * Builds a forwarding table from the routing table, the equal cost next
+ * hops, and the backups. Only valid after dijkstra(), and update_lfas()
+ * or clear_lfas().
+ */
+Fib_table *build_fib_table() {
+  Fib_table *table;
+
+  table = malloc(sizeof(Fib_table) + router.num_nodes * sizeof(Fib_entry));
+  if(table == NULL) {
+    perror("build_fib_table: malloc");
+    exit(1);
+  }
+  table->next_retired = NULL;
+  table->index = hold_fib_index();
+  table->num_entries = router.num_nodes;
+
+  for(int i=0; i<router.num_nodes; i++) {
+    int next_hop = route_next_hop(i), backup = lfa.backup[i];
+    Node *node = &router.nodes[i];
+    Fib_entry *entry = &table->entries[i];
+
+    entry->next_hop = entry->port = entry->tunnel = UNSET;
+    entry->backup_next_hop = entry->backup_port = entry->backup_tunnel = UNSET;
+    entry->num_paths = 0;
+    if(next_hop != UNSET) {
+      entry->next_hop = router.nodes[next_hop].id;
+      entry->port = fib.port[next_hop];
+      entry->path_next_hops[0] = entry->next_hop;
+      entry->path_ports[0] = entry->port;
+      entry->num_paths = 1;
+    }
+
+    /* Shortest paths may be spread over several next hops */
+    if(next_hop != UNSET && node->is_preferred == FALSE &&
+       node->uses_path_vector == FALSE) {
+      int *ecmp = spf.ecmp + (size_t)i * MAX_ECMP_PATHS;
+      for(int k=1; k<MAX_ECMP_PATHS && ecmp[k] != UNSET; k++) {
+        entry->path_next_hops[entry->num_paths] = router.nodes[ecmp[k]].id;
+        entry->path_ports[entry->num_paths++] = fib.port[ecmp[k]];
+      }
+    }
+    if(backup != UNSET) {
+      entry->backup_next_hop = router.nodes[backup].id;
+      entry->backup_port = fib.port[backup];
+      if(lfa.tunnel[i] != UNSET)
+        entry->backup_tunnel = router.nodes[lfa.tunnel[i]].id;
+    }
+  }
+
+  return table;
+}
+
+/*
+ * void
+ * update_fib
+ *
+ * If the forwarding table is out of date, recomputes the routing table,
+ * builds a new forwarding table from it, and publishes it for the
+ * forwarding thread. Otherwise does nothing.
+ */
+void update_fib() {
+  int max_nodes = fib.max_nodes;
+
+  if(fib.is_dirty == FALSE)
+    return;
+
+  dijkstra(router.id);
+
+  grow_array((void **)&fib.port, &max_nodes, router.num_nodes, sizeof(int));
+  fib.max_nodes = max_nodes;
+
+  /* The first neighbor with a given ID is the one messages go to */
+  for(int i=0; i<router.num_nodes; i++)
+    fib.port[i] = UNSET;
+  for(int i=router.num_neighbors - 1; i>=0; i--) {
+    int index = lookup_node(router.neighbors[i].id);
+    if(index != UNSET)
+      fib.port[index] = router.neighbors[i].port;
+  }
+
+  /*
+   * Computing the distances the backups are chosen from takes two runs of
+   * SPF per link of this router. When the topology changed, the new routes
+   * are published first, without backups, and the backups follow.
+   */
+  if(lfa.is_dirty == TRUE || lfa.num_nodes != router.num_nodes) {
+    clear_lfas();
+    publish_fib_table(build_fib_table());
+    update_lfa_distances();
+  }
+  update_lfas();
+
+  publish_fib_table(build_fib_table());
+  fib.is_dirty = FALSE;
+
+  /* Whatever was pending is done */
+  if(spf_throttle.is_scheduled == TRUE)
+    cancel_timer(spf_throttle.timer);
+  spf_throttle.is_scheduled = FALSE;
+  spf_throttle.seen_changes = fib.num_changes;
+  spf_throttle.last_run = monotonic_time();
+  spf_throttle.num_runs++;
+}
+
+/*
+ * void
+ * schedule_spf
+ *
+ * Called after every batch of events. If they changed the topology or the
+ * policies, schedules the computation of the routes, unless one is already
+ * pending: the changes are then taken along with it, and the run they
+ * would have caused is counted as suppressed. Until it runs, messages
+ * keep using the published table, repaired around the lost neighbors.
+ */
+void schedule_spf() {
+  long int now, expires;
+
+  if(fib.is_dirty == FALSE || spf_throttle.seen_changes == fib.num_changes)
+    return;
+  spf_throttle.seen_changes = fib.num_changes;
+
+  if(spf_throttle.is_scheduled == TRUE) {
+    spf_throttle.num_suppressed++;
+    return;
+  }
+
+  now = monotonic_time();
+  expires = now + SPF_INITIAL_DELAY;
+  if(now - spf_throttle.last_run >= SPF_MAX_HOLD_TIME)
+    spf_throttle.hold = SPF_HOLD_TIME;
+  else {
+    /* Changes keep coming, back off */
+    if(spf_throttle.last_run + spf_throttle.hold > expires)
+      expires = spf_throttle.last_run + spf_throttle.hold;
+    spf_throttle.hold = (spf_throttle.hold * 2 > SPF_MAX_HOLD_TIME) ?
+                        SPF_MAX_HOLD_TIME : spf_throttle.hold * 2;
+  }
+
+  schedule_timer(spf_throttle.timer, expires);
+  spf_throttle.is_scheduled = TRUE;
+}
+
+/*
+ * void
+ * publish_fib_table
+ *
+ * Makes `table` the forwarding table, and gets rid of the ones no longer
+ * in use.
+ */
+void publish_fib_table(Fib_table *table) {
+  Fib_table *old_table = fib.table;
+
+  __atomic_store_n(&fib.table, table, __ATOMIC_SEQ_CST);
+  if(old_table != NULL)
+    retire_fib_table(old_table);
+  reclaim_fib_tables();
+}
+
+/*
+ * void
+ * repair_fib
+ *
+ * Publishes a copy of the forwarding table in which the destinations
+ * reached through the router with ID `next_hop`, which just failed, are
+ * sent to the other equal cost next hops, or else to their backups.
+ * Traffic moves over right away, ahead of the new shortest path tree;
+ * destinations without either are dropped until then.
+ */
+void repair_fib(int next_hop) {
+  Fib_table *table;
+  size_t size;
+
+  if(fib.table == NULL)
+    return;
+
+  size = sizeof(Fib_table) + fib.table->num_entries * sizeof(Fib_entry);
+  table = malloc(size);
+  if(table == NULL) {
+    perror("repair_fib: malloc");
+    exit(1);
+  }
+  memcpy(table, fib.table, size);
+  table->next_retired = NULL;
+  table->index->refs++;
+
+  for(int i=0; i<table->num_entries; i++) {
+    Fib_entry *entry = &table->entries[i];
+    int num_paths = 0;
+    for(int k=0; k<entry->num_paths; k++) {
+      if(entry->path_next_hops[k] != next_hop) {
+        entry->path_next_hops[num_paths] = entry->path_next_hops[k];
+        entry->path_ports[num_paths++] = entry->path_ports[k];
+      }
+    }
+    entry->num_paths = num_paths;
+    if(entry->next_hop != next_hop)
+      continue;
+    if(num_paths > 0) {
+      entry->next_hop = entry->path_next_hops[0];
+      entry->port = entry->path_ports[0];
+      continue;
+    }
+    entry->next_hop = entry->backup_next_hop;
+    entry->port = entry->backup_port;
+    entry->tunnel = entry->backup_tunnel;
+    entry->backup_next_hop = entry->backup_port = entry->backup_tunnel = UNSET;
+  }
+
+  publish_fib_table(table);
+}
+
+/*
+ * void
+ * clear_lfas
+ *
+ * Sizes the backups for the current nodes, and clears them.
+ */
+void clear_lfas() {
+  int max = lfa.max_nodes;
+
+  grow_array((void **)&lfa.backup, &max, router.num_nodes, sizeof(int));
+  max = lfa.max_nodes;
+  grow_array((void **)&lfa.tunnel, &max, router.num_nodes, sizeof(int));
+  lfa.max_nodes = max;
+
+  for(int i=0; i<router.num_nodes; i++)
+    lfa.backup[i] = lfa.tunnel[i] = UNSET;
+}
+
+/*
+ * The distances from each neighbor, to each neighbor, to this router, and
+ * from each PQ node are kept in rows of lfa.dist, in that order.
+ */
+#define LFA_FROM(k) (lfa.dist + (size_t)(k) * lfa.num_nodes)
+#define LFA_TO(k) (lfa.dist + (size_t)(num_links + (k)) * lfa.num_nodes)
+#define LFA_FROM_PQ(k) \
+  (lfa.dist + (size_t)(2 * num_links + (k)) * lfa.num_nodes)
+#define LFA_TO_SELF (lfa.dist + (size_t)3 * num_links * lfa.num_nodes)
+
+/*
+ * void
+ * update_lfa_distances
+ *
+ * Computes the rows of distances the backups are chosen from (see
+ * update_lfas()), and the remote LFA of each link of this router. Only
+ * valid after dijkstra().
+ */
+void update_lfa_distances() {
+  Node *self = &router.nodes[router.index];
+  int num_nodes = router.num_nodes, num_links = self->num_links, max;
+  int S = router.index;
+
+  max = lfa.max_links;
+  grow_array((void **)&lfa.pq_node, &max, num_links, sizeof(int));
+  max = lfa.max_links;
+  grow_array((void **)&lfa.pq_via, &max, num_links, sizeof(int));
+  lfa.max_links = max;
+  grow_array((void **)&lfa.dist, &lfa.max_dist,
+             (3 * num_links + 1) * num_nodes, sizeof(int));
+  lfa.num_nodes = num_nodes;
+  lfa.is_dirty = FALSE;
+  if(num_links < 2)
+    return;
+
+  for(int k=0; k<num_links; k++) {
+    spf_distances(self->links[k].to, LFA_FROM(k), FALSE);
+    spf_distances(self->links[k].to, LFA_TO(k), TRUE);
+  }
+  spf_distances(S, LFA_TO_SELF, TRUE);
+
+  /* The remote LFA of each link, the closest PQ node */
+  for(int e=0; e<num_links; e++) {
+    long int best = MAX_INT;
+    lfa.pq_node[e] = lfa.pq_via[e] = UNSET;
+    for(int p=0; p<num_nodes; p++) {
+      if(p == S || LFA_TO(e)[p] == MAX_INT || LFA_TO_SELF[p] == MAX_INT ||
+         LFA_TO(e)[p] >= (long int)LFA_TO_SELF[p] + self->links[e].cost)
+        continue;
+      for(int k=0; k<num_links; k++) {
+        int *from = LFA_FROM(k);
+        long int cost = (long int)self->links[k].cost + from[p];
+        if(k == e || from[p] == MAX_INT || spf.dist[p] == MAX_INT ||
+           from[p] >= (long int)from[S] + spf.dist[p] || cost >= best)
+          continue;
+        best = cost;
+        lfa.pq_node[e] = p;
+        lfa.pq_via[e] = k;
+      }
+    }
+    if(lfa.pq_node[e] != UNSET)
+      spf_distances(lfa.pq_node[e], LFA_FROM_PQ(e), FALSE);
+  }
+}
+
+/*
+ * void
+ * update_lfas
+ *
+ * Computes a backup next hop for every destination reached over the
+ * shortest path tree. Once dijkstra() ran, S being this router, E the
+ * next hop to destination D, and N another neighbor:
+ *
+ * - N is a loop-free alternate if its path to D doesn't come back through
+ *   S: dist(N, D) < dist(N, S) + dist(S, D). It also protects against E
+ *   failing altogether if dist(N, D) < dist(N, E) + dist(E, D); those are
+ *   preferred, then the cheapest.
+ * - Otherwise, messages can be tunneled to a remote LFA (a PQ node) over
+ *   N: a node P that N reaches without going through S, from which E is
+ *   reached without the link S-E: dist(P, E) < dist(P, S) + cost(S, E).
+ *   It has to reach D without going through S either.
+ *
+ * The distances are those of the last update_lfa_distances(), which has
+ * to have run since the topology last changed; paths and policies only
+ * change which destinations are reached over the tree.
+ */
+void update_lfas() {
+  Node *self = &router.nodes[router.index];
+  int num_links = self->num_links;
+  int S = router.index;
+
+  clear_lfas();
+  if(num_links < 2)
+    return;
+
+  for(int d=0; d<router.num_nodes; d++) {
+    Node *node = &router.nodes[d];
+    int next_hop = route_next_hop(d), e = UNSET, best = UNSET;
+    int best_protects = FALSE;
+    long int best_cost = 0;
+
+    if(d == S || next_hop == UNSET ||
+       node->is_preferred == TRUE || node->uses_path_vector == TRUE)
+      continue;
+    for(int k=0; k<num_links; k++)
+      if(self->links[k].to == next_hop)
+        e = k;
+    if(e == UNSET)
+      continue;
+
+    for(int k=0; k<num_links; k++) {
+      int *from = LFA_FROM(k);
+      if(k == e || from[d] == MAX_INT ||
+         from[d] >= (long int)from[S] + spf.dist[d])
+        continue;
+      int protects = (d != next_hop) &&
+                     (from[next_hop] == MAX_INT || LFA_FROM(e)[d] == MAX_INT ||
+                      from[d] < (long int)from[next_hop] + LFA_FROM(e)[d]);
+      long int cost = (long int)self->links[k].cost + from[d];
+      if(best == UNSET || protects > best_protects ||
+         (protects == best_protects && cost < best_cost)) {
+        best = k;
+        best_protects = protects;
+        best_cost = cost;
+      }
+    }
+
+    if(best != UNSET)
+      lfa.backup[d] = self->links[best].to;
+    else if(lfa.pq_node[e] != UNSET) {
+      int p = lfa.pq_node[e];
+      if(LFA_FROM_PQ(e)[d] != MAX_INT &&
+         LFA_FROM_PQ(e)[d] < (long int)LFA_TO_SELF[p] + spf.dist[d]) {
+        lfa.backup[d] = self->links[lfa.pq_via[e]].to;
+        lfa.tunnel[d] = p;
+      }
+    }
+  }
+}
+
+/*
+ * void
+ * print_neighbors
+ *
+ * Print all neighbors of the current node per the format specified in
+ * the spec.
+ */
+void print_neighbors() {
+    Node *self = &router.nodes[router.index];
+    int *ids = malloc((self->num_links + 1) * sizeof(int));
+    if(ids == NULL) {
+      perror("print_neighbors: malloc");
+      exit(1);
+    }
+    for(int i=0; i<self->num_links; i++)
+      ids[i] = router.nodes[self->links[i].to].id;
+    qsort(ids, self->num_links, sizeof(int), compare_ints);
+    for(int i=0; i<self->num_links; i++)
+      printf("%d ", ids[i]);
+    printf("\n\n");
+    free(ids);
+}
+
+/*
+ * void
+ * print_backups
+ *
+ * Prints the next hop to each reachable router, the other equal cost ones,
+ * and the backup it would switch to if they all failed, along with the
+ * remote LFA messages are tunneled to, if any.
+ */
+void print_backups() {
+  update_fib();
+
+  for(int i=0; i<router.num_nodes; i++) {
+    int next_hop = route_next_hop(i), backup = lfa.backup[i];
+    if(i == router.index || next_hop == UNSET)
+      continue;
+    printf("%d: next hop %d", router.nodes[i].id, router.nodes[next_hop].id);
+    if(router.nodes[i].is_preferred == FALSE &&
+       router.nodes[i].uses_path_vector == FALSE) {
+      int *ecmp = spf.ecmp + (size_t)i * MAX_ECMP_PATHS;
+      for(int k=1; k<MAX_ECMP_PATHS && ecmp[k] != UNSET; k++)
+        printf(" or %d", router.nodes[ecmp[k]].id);
+    }
+    if(backup == UNSET)
+      printf(", no backup");
+    else
+      printf(", backup %d", router.nodes[backup].id);
+    if(lfa.tunnel[i] != UNSET)
+      printf(" through %d", router.nodes[lfa.tunnel[i]].id);
+    printf("\n");
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+/*
+ * void
+ * print_routing_table
+ *
+ * Prints the routes to the reachable neighbors. The paths are walked out
+ * of the shortest path tree as they are printed.
+ */
+void print_routing_table() {
+  int *hops = NULL, max_hops = 0;
+
+  update_fib();
+
+	for(int id=0; id<router.max_node_id; id++) {
+    int index = router.node_index[id];
+		if(index == UNSET)
+      continue;
+    int length = route_length(index);
+    grow_array((void **)&hops, &max_hops, length, sizeof(int));
+    route_path(index, hops, length);
+    for(int j=0; j<length; j++)
+      printf("%d ", hops[j]);
+    if(length != 0)
+      printf("\n");
+  }
+  printf("\n");
+  free(hops);
+}
+
+/*
+ * If a given packet was of type PING, we can be sure that is from one of the
+ * router's neighbors. So, simply update the last seen of that neighbor, and
+ * don't forward the packet. The times are those of this router, the clock
+ * of the sender doesn't matter.
+ */
+void process_ping_packet(const Ping_packet *p) {
+  int sender_id, sender_LS_port, sender_PV_port;
+
+  /* Get all the values stored in the packet */
+  sender_id = p->sender_id;
+
+  /* Drop if the id is invalid, or one that we have rejected */
+  if(sender_id < 0 || sender_id > MAX_ROUTER_ID ||
+     sender_id == router.id || is_rejected(sender_id))
+    return;
+
+  sender_LS_port = p->sender_LS_port;
+  sender_PV_port = p->sender_PV_port;
+
+  /* Drop if it doesn't say when to expect the next one */
+  if(p->interval < 1 || p->interval > MAX_HELLO_INTERVAL ||
+     p->detect_multiplier < 1 || p->detect_multiplier > MAX_DETECT_MULTIPLIER)
+    return;
+
+  /* Update the last seen for that neighbor */
+  int num_neighbors = router.num_neighbors;
+  for(int i=0; i < num_neighbors; i++) {
+    if((router.neighbors[i].port == sender_LS_port) ||
+       ((router.neighbors[i].port == sender_PV_port) && 
+        (router.neighbors[i].is_paired == TRUE))) {
+      Neighbor *neighbor = &router.neighbors[i];
+      int is_new = (neighbor->is_up == FALSE);
+
+      /* It is down once it misses as many hellos as it said */
+      neighbor->hold_time = p->interval * p->detect_multiplier;
+      neighbor->last_seen = monotonic_time();
+      neighbor->is_up = TRUE;
+      schedule_timer(neighbor->expiry_timer,
+                     neighbor->last_seen + neighbor->hold_time);
+      if(neighbor->id != sender_id) {
+        neighbor->id = sender_id;
+        is_new = TRUE;
+        invalidate_fib();
+      }
+
+      /* A neighbor that (re)appeared goes into our advertisement */
+      if(is_new == TRUE)
+        originate_lsa(FALSE);
+      break;
+    }
+  }
+
+}
+
+/*
+ * long int
+ * last_keepalive
+ *
+ * Returns when the forwarding thread last received a link state packet
+ * relayed by neighbor `i`, or a path vector packet from it if it is a
+ * peer, 0 if it never did.
+ */
+long int last_keepalive(int i) {
+  Neighbor *neighbor = &router.neighbors[i];
+
+  if(neighbor->is_paired == TRUE) {
+    if(neighbor->port < 0 || neighbor->port > 0xffff)
+      return 0;
+    return __atomic_load_n(&keepalives.by_port[neighbor->port],
+                           __ATOMIC_RELAXED);
+  }
+  if(neighbor->id < 0 || neighbor->id > MAX_ROUTER_ID)
+    return 0;
+  return __atomic_load_n(&keepalives.by_id[neighbor->id], __ATOMIC_RELAXED);
+}
+
+/*
+ * void
+ * stamp_keepalive
+ *
+ * Called by the forwarding thread for every control packet other than a
+ * hello, before it is queued: if it is a link state or path vector packet,
+ * notes that its sender is alive. Only the fields that say who sent it are
+ * decoded.
+ */
+void stamp_keepalive(const char *buff, int cc, int type) {
+  int key_length, port;
+  char key[10];
+  Wire w;
+
+  if(type == DATA) {
+    wire_open(&w, buff, cc);
+    uint32_t id = wire_get_u32(&w);
+    if(w.error == FALSE && id <= MAX_ROUTER_ID)
+      __atomic_store_n(&keepalives.by_id[id], monotonic_time(),
+                       __ATOMIC_RELAXED);
+  }
+  else if(type == PV) {
+    wire_open(&w, buff, cc);
+    key_length = wire_get_int(&w);
+    if(key_length > (int)sizeof(key))
+      return;
+    wire_get_bytes(&w, key, key_length);
+    port = wire_get_int(&w);
+    if(w.error == FALSE && port <= 0xffff)
+      __atomic_store_n(&keepalives.by_port[port], monotonic_time(),
+                       __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * void
+ * refresh_neighbor
+ *
+ * Takes a link state or path vector packet from neighbor `i` as a hello,
+ * if it is up: it stays up for as long as its last hello said.
+ */
+void refresh_neighbor(int i) {
+  Neighbor *neighbor = &router.neighbors[i];
+
+  if(neighbor->is_up == FALSE)
+    return;
+  neighbor->last_seen = monotonic_time();
+  schedule_timer(neighbor->expiry_timer,
+                 neighbor->last_seen + neighbor->hold_time);
+}
+
+/*
+ * If a given packet is of type MSG, if this router is not the destination
+ * of the message, send it along its path
+ */
+void process_msg_packet(const Msg_packet *p) {
+  int dest, tunnel;
+  dest = p->dest;
+
+  /* Make sure the destination is a valid id */
+  if((dest < 0) || (dest > MAX_ROUTER_ID)) {
+    printf("Invalid destination.\n");
+    return;
+  }
+
+  /* If this router is the destinatioon of the msg, just return */
+  if(dest == router.id)
+      return;
+
+  /* The end of the tunnel, if any, forwards it as usual */
+  tunnel = p->tunnel;
+  if(tunnel == router.id)
+    tunnel = UNSET;
+  if(tunnel != UNSET && (tunnel < 0 || tunnel > MAX_ROUTER_ID)) {
+    printf("Invalid tunnel.\n");
+    return;
+  }
+
+  forward_msg(dest, tunnel, p->flow);
+}
+
+/*
+ * void
+ * process_pv_packet
+ *
+ * Process path vector packet and update routing table 
+ */
+void process_pv_packet(const Pv_packet *p) {
+  int peer = UNSET;
+
+  /* Ensure that the packet is from a paired neighbor */
+  for(int i=0; i<router.num_neighbors; i++) {
+    if((router.neighbors[i].port == p->sender_PV_port) &&
+       (router.neighbors[i].is_paired == TRUE) &&
+       (strncmp(p->key, router.neighbors[i].key, 10) == 0))
+      peer = i;
   }
-  int dest = path[path_length - 1];
-  for(i=0; i<path_length; i++)
-    router.routing_table[dest][i] = path[i];
+  if(peer == UNSET)
+    return;
+  refresh_neighbor(peer);
+  router.rib_out[peer].is_synced = TRUE;
 
-  router.is_preferred[dest] = TRUE;
+  /* Send it all of our paths again, if it asked */
+  if(p->flags & PV_REFRESH) {
+    clear_adj_rib_out(peer);
+    send_pv_update(peer);
+  }
 
-  printf("Prefer policy set: ");
-  printf("%d -> ", router.id);
-  for(i=0; i< path_length-1; i++)
-    printf("%d -> ", path[i]);
-  printf("%d\n\n", dest);
+  for(int i=0; i<p->num_withdrawn; i++)
+    withdraw_pv_route(peer, p->withdrawn[i]);
+  for(int i=0; i<p->num_routes; i++)
+    process_pv_route(peer, &p->routes[i]);
 }
 
 /*
  * void
- * handle_stdin
+ * withdraw_pv_route
  *
- * Handle the standard input from the user and call the appropriate
- * functions
+ * Peering session `peer` no longer offers a path to `dest`: the best of
+ * the paths the other sessions offered takes over, if any.
  */
-void handle_stdin(char buff[80]) {  
-  char c;
-  int i;
+void withdraw_pv_route(int peer, int dest) {
+  Adj_rib_in *rib = &router.rib_in[peer];
+  int index = lookup_node(dest);
 
-  /* If only one character is present */
-  if(sscanf(buff, "%c", &c) == 1) {
-    switch(buff[0]) {
-      case 'N':
-        print_neighbors();
-        return;
-      case 'T':
-        print_routing_table();
-        return;
-      case 'p':
-        print_router();
-        return;
-    }
+  if(index == UNSET || index >= rib->max_paths || rib->paths[index] == NULL)
+    return;
+  release_path(rib->paths[index]);
+  rib->paths[index] = NULL;
+  select_pv_path(index);
+}
+
+/*
+ * void
+ * process_pv_route
+ *
+ * Stores the path peering session `peer` offers in its Adj-RIB-In, in
+ * place of the one it offered before, and selects the best path to the
+ * destination again.
+ */
+void process_pv_route(int peer, const struct Path_vector *pv) {
+  Adj_rib_in *rib = &router.rib_in[peer];
+  int dest = pv->dest;
+
+  /* If the destination is this router itself, or invalid, drop it */
+  if(dest == router.id || dest < 0 || dest > MAX_ROUTER_ID)
+    return;
+
+  /* The advertised path has to go from the peer to the destination */
+  if(pv->length < 1 || pv->path[0] != router.neighbors[peer].id ||
+     pv->path[pv->length - 1] != dest) {
+    withdraw_pv_route(peer, dest);
+    return;
   }
 
-  /* To send messages */
-  if(sscanf(buff, "%d", &i) == 1) {
-    if(i >= 0 && i<=19)
-      send_msg(i);
-      return;
+  int index = add_node(dest);
+  int max_prefs = rib->max_paths;
+  grow_array((void **)&rib->paths, &rib->max_paths, router.num_nodes,
+             sizeof(Path *));
+  grow_array((void **)&rib->prefs, &max_prefs, router.num_nodes,
+             sizeof(int));
+
+  /* Nothing to decide if it didn't change */
+  Path *path = new_path(pv->path, pv->length);
+  if(path == rib->paths[index]) {
+    release_path(path);
+    return;
   }
+  release_path(rib->paths[index]);
+  rib->paths[index] = path;
+  rib->prefs[index] = evaluate_policy(dest, path);
+  select_pv_path(index);
+}
 
-  /* Reject policy */
- 	if(sscanf(buff, "R %d", &i) == 1) {
-    if(i < 0 || i > 19)
-      printf("Invalid router ID specified.");
-		else if(router.is_border_router == FALSE) {
-			printf("Reject commands can be run only on border routers.\n");
-		}
-		else {
-			printf("Router rejected: %d.", i);
-      reject(i);
-    }
-    printf("\n\n");
-		fflush(stdout);
-		return;
-	}
+/*
+ * void
+ * select_pv_path
+ *
+ * Decides which of the paths offered by the peering sessions the route to
+ * node `index` takes, among those the policy accepts and that go through
+ * no rejected router and don't loop back through this one: the one with
+ * the highest local preference, then the shortest, the peer with the
+ * lowest ID winning ties. The route falls back to the shortest path tree
+ * if none qualifies. A preferred path is left alone.
+ */
+void select_pv_path(int index) {
+  Node *node = &router.nodes[index];
+  Path *best = NULL;
+  int best_peer = UNSET, best_pref = UNSET;
 
-  /* Prefer policy */
-  if(buff[0] == 'P') {
-		if(router.is_border_router == FALSE) {
-			printf("Commands to set preferred paths can be run only on \
-              border routers.\n\n");
-      fflush(stdout);
-      return;
-		}
+  if(node->is_preferred == TRUE)
+    return;
 
-    set_prefer_policy(buff);
+  for(int i=0; i<router.num_neighbors; i++) {
+    Adj_rib_in *rib = &router.rib_in[i];
+    int peer = router.neighbors[i].id;
+    if(router.neighbors[i].is_paired == FALSE || index >= rib->max_paths ||
+       rib->paths[index] == NULL)
+      continue;
 
-    return;
-  }
+    Path *path = rib->paths[index];
+    int pref = rib->prefs[index];
+    if(pref == UNSET || is_usable_path(path) == FALSE)
+      continue;
 
-  int id, port;
-  char key[10];
-  /* Create a peering session */
-  if(sscanf(buff, "S %d %d %s", &id, &port, key) == 3) {
-		if(router.is_border_router == FALSE) {
-			printf("Commands to create a peering session can be run only on \
-              border routers.");
+    if(best == NULL || pref > best_pref ||
+       (pref == best_pref && (path->length < best->length ||
+       (path->length == best->length && peer < best_peer)))) {
+      best = path;
+      best_peer = peer;
+      best_pref = pref;
     }
-    else {
-      create_peering_session(id, port, key);
+  }
+
+  if(best == NULL) {
+    if(node->uses_path_vector == TRUE) {
+      node->uses_path_vector = FALSE;
+      set_path(index, NULL);
     }
-    printf("\n\n");
-    fflush(stdout);
     return;
-  
   }
 
-  printf("Invalid command.\n\n");
-  return;
-      
+  /* Keep the path in use if it is the same */
+  if(node->uses_path_vector == TRUE && node->path == best)
+    return;
+  node->uses_path_vector = TRUE;
+  set_path(index, hold_path(best));
 }
 
 /*
- * void
- * reject
+ * int
+ * is_usable_path
  *
- * Sets up reject policy for router with id=`id`
+ * Returns TRUE if `path` goes through neither a rejected router nor this
+ * one. The hops are only looked at if the bloom filters say it might.
  */
-void reject(int id) {
-  router.is_rejected[id] = TRUE;
-
-  /* Update routing table */
-  for(int i=0; i<20; i++)
-    for(int j=0; j<20; j++)
-      if(router.routing_table[i][j] == id)
-        router.routing_table[id][0] = -1;
-
+int is_usable_path(const Path *path) {
+  uint64_t avoided = router.rejected_bloom | id_bloom(router.id);
+
+  if((path->bloom & avoided) == 0)
+    return TRUE;
+  for(int i=0; i<path->length; i++)
+    if(path->hops[i] == router.id || is_rejected(path->hops[i]))
+      return FALSE;
+  return TRUE;
 }
 
 /*
  * void
- * create_peering_session
+ * clear_adj_rib_in
  *
- * Sets up a peering session w/ router with given args
+ * Forgets the paths peering session `i` offered, when it is lost, moving
+ * the routes that used them to the next best path right away.
  */
-void create_peering_session(int id, int port, char key[10]) {
-  int num_neighbors = router.num_neighbors;
-  router.neighbors[num_neighbors].id = id;
-  router.neighbors[num_neighbors].port = port;
-  router.neighbors[num_neighbors].is_paired = TRUE;
-  strncpy(router.neighbors[num_neighbors].key, key, 10);
-  router.num_neighbors = num_neighbors + 1;
-  printf("Session created with router %d at port %d using key %s.", 
-          id, port, key);
+void clear_adj_rib_in(int i) {
+  Adj_rib_in *rib = &router.rib_in[i];
+
+  for(int j=0; j<rib->max_paths; j++) {
+    if(rib->paths[j] == NULL)
+      continue;
+    release_path(rib->paths[j]);
+    rib->paths[j] = NULL;
+    select_pv_path(j);
+  }
 }
 
 /*
  * void
- * send_msg
+ * process_link_state_packet
  *
- * Send a message to `dest` (as part of a msg sent via the console)
+ * Process link state packet and update the link state database. Only an
+ * advertisement newer than the installed one is installed and flooded on,
+ * in place, so the packet has to stay intact until the queue is flushed.
+ * A sender that has an older one is sent ours instead.
  */
-void send_msg(int dest) {
+void process_link_state_packet(const Link_state_packet *p) {
+  int sender_id, relayed_by, num_neighbors;
+  unsigned int sequence;
+  long int now = monotonic_time();
 
-  /* initialize packet */
-  Msg_packet p;
-  p.dest = htonl(dest);
+  sender_id = p->sender_id;
+  relayed_by = p->relayed_by;
+  sequence = p->sequence;
 
-  Link_state_packet dp; Ping_packet pp; Pv_packet pvp;
+  if(sender_id < 0 || sender_id > MAX_ROUTER_ID || is_rejected(sender_id) ||
+     evaluate_policy(sender_id, NULL) == UNSET)
+    return;
 
-  int next_hop;
+  /* Whatever it carries, it shows that the neighbor relaying it is alive */
+  for(int i=0; i<router.num_neighbors; i++)
+    if(router.neighbors[i].id == relayed_by &&
+       router.neighbors[i].is_paired == FALSE)
+      refresh_neighbor(i);
 
-  dijkstra(router.id);
+  /* Get the number of neighbors */
+  num_neighbors = p->num_neighbors;
+
+  int sender = add_node(sender_id);
+  Lsa *old = router.nodes[sender].lsa;
+
+  /*
+   * One of our own, from before a restart: carry on from its sequence
+   * number, so that the next advertisement supersedes it
+   */
+  if(sender == router.index) {
+    if(sequence_is_newer(sequence, router.lsa_sequence)) {
+      router.lsa_sequence = sequence;
+      originate_lsa(TRUE);
+    }
+    return;
+  }
 
-	next_hop = router.routing_table[dest][0];
+  /* Drop the ones we have already seen, and correct older ones */
+  if(old != NULL && sequence_is_newer(sequence, old->sequence) == FALSE) {
+    if(sequence_is_newer(old->sequence, sequence))
+      send_lsa_to(sender, relayed_by);
+    return;
+  }
 
-  /* If the node is unreachable, drop the packet */
-	if((next_hop == MAX_INT) || (next_hop == UNSET)) {
-		printf("Unable to send message to %d.\n\n", dest);
-		return;
-	}
+  /* Install the adjacencies it lists */
+  Lsa *lsa = malloc(sizeof(Lsa) + num_neighbors * sizeof(Link));
+  if(lsa == NULL) {
+    perror("process_link_state_packet: malloc");
+    exit(1);
+  }
+  lsa->sequence = sequence;
+  lsa->num_links = 0;
+  for(int i=0; i<num_neighbors; i++) {
+    const Lsa_neighbor *advertised = &p->neighbors[i];
+    if(advertised->id == sender_id)
+      continue;
+    int neighbor = add_node(advertised->id);
+    if(neighbor == UNSET || lsa_find_link(lsa, neighbor) != NULL)
+      continue;
+    Link *link = &lsa->links[lsa->num_links++];
+    link->to = neighbor;
+    link->cost = advertised->cost;
+    if(link->cost < 1 || link->cost > MAX_LINK_COST)
+      link->cost = DEFAULT_LINK_COST;
+    link->last_seen = now;
+  }
+  install_lsa(sender, lsa);
+
+  /*
+   * Relay it over the flooding tree only, if it came in over the tree or
+   * straight from its origin. If it came from anywhere else, the sender
+   * computed a different tree, so flood it everywhere until the
+   * databases agree again.
+   */
+  int use_tree = FALSE;
+  if(flood_tree.is_enabled == TRUE) {
+    int from = lookup_node(relayed_by);
+    update_flood_tree();
+    use_tree = (from == sender) ||
+               (from != UNSET && from < flood_tree.max_nodes &&
+                flood_tree.is_tree_neighbor[from] == TRUE);
+  }
 
-  /* If not, send it on to the next hop */
+  /* And flood it on, except back where it came from */
+  wire_set_u32(p->buff + WIRE_HEADER_SIZE, router.id);
   for(int i=0; i<router.num_neighbors; i++) {
-    if(router.neighbors[i].id == next_hop) {
-      send_one_packet(router.neighbors[i].port, MSG, pp, p, pvp, dp);
-      break;
+    int neighbor_id = router.neighbors[i].id;
+    if(neighbor_id == relayed_by || neighbor_id == sender_id)
+      continue;
+    if(use_tree == TRUE) {
+      int neighbor = lookup_node(neighbor_id);
+      if(neighbor == UNSET || neighbor >= flood_tree.max_nodes ||
+         flood_tree.is_tree_neighbor[neighbor] == FALSE) {
+        flood_tree.floods_avoided++;
+        continue;
+      }
     }
+    send_packet(router.neighbors[i].port, p->buff, p->cc);
+    router.neighbors[i].last_sent = monotonic_time();
   }
 
-  printf("%d\n\n", next_hop);
-  fflush(stdout);
+  return;
+}
+
+/*
+ * void
+ * add_event_source
+ *
+ * Registers `fd` with the event loop, so that `handle` is called every
+ * time it becomes readable.
+ */
+void add_event_source(int fd, void (*handle)(int fd)) {
+  struct epoll_event ev;
+  Event_source *source = malloc(sizeof(Event_source));
 
+  if(source == NULL) {
+    perror("add_event_source: malloc");
+    exit(1);
+  }
+  source->fd = fd;
+  source->handle = handle;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = source;
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("add_event_source: epoll_ctl");
+    free(source);
+  }
 }
 
 /*
- * Ping all the neighbors of the router
+ * void
+ * remove_event_source
+ *
+ * Stops watching `fd`. The Event_source itself is leaked on purpose, as
+ * events for it might still be pending in the current epoll_wait() batch.
  */
-void ping_neighbors() {
+void remove_event_source(int fd) {
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+    perror("remove_event_source: epoll_ctl");
+}
 
-  /* Initialize packet */
-  Ping_packet p;
-  Link_state_packet dp; Msg_packet mp; Pv_packet pvp;
+/*
+ * int
+ * create_timer
+ *
+ * Creates a periodic timerfd (on the monotonic clock) that fires every
+ * `interval` milliseconds, and returns it. With an `interval` of 0, it is
+ * left disarmed.
+ */
+int create_timer(long int interval) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
 
-  /* Get current time and set timestamp */
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  long int current_time = now.tv_sec;
-  p.timestamp = htonl(current_time);
+  if(fd < 0) {
+    perror("create_timer: timerfd_create");
+    exit(1);
+  }
+  set_timer_interval(fd, interval);
+  return fd;
+}
 
-  /* Set the other credentials */
-  p.sender_id = htonl(router.id);
-  p.sender_LS_port = htonl(router.myLSport);
-  p.sender_PV_port = htonl(router.myPVport);
+/*
+ * void
+ * set_timer_interval
+ *
+ * Makes the timerfd `fd` fire every `interval` milliseconds, starting
+ * `interval` milliseconds from now.
+ */
+void set_timer_interval(int fd, long int interval) {
+  struct itimerspec spec;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = interval / 1000;
+  spec.it_value.tv_nsec = (interval % 1000) * 1000000;
+  spec.it_interval = spec.it_value;
+  if(timerfd_settime(fd, 0, &spec, NULL) < 0) {
+    perror("set_timer_interval: timerfd_settime");
+    exit(1);
+  }
+}
 
-  /* Ping each neighbor with the packet */
-  for(int i=0; i < router.num_neighbors; i++)
-    send_one_packet(router.neighbors[i].port, PING,  p, mp, pvp, dp);
+/*
+ * void
+ * back_off_interval
+ *
+ * Doubles `interval`, which is driven by the timerfd `fd`, if it went by
+ * without a change, up to `max_factor` times `base` and `max`.
+ */
+void back_off_interval(int *interval, int base, int max, int fd) {
+  long int limit = (long int)base * adaptive.max_factor;
+
+  if(limit > max)
+    limit = max;
+  if(monotonic_time() - adaptive.last_change < *interval ||
+     *interval >= limit)
+    return;
+  *interval = (2L * *interval > limit) ? limit : 2 * *interval;
+  set_timer_interval(fd, *interval);
 }
 
 /*
  * void
- * send_path_vector_packets()
+ * reset_intervals
  *
- * Send all paired neighbors path vectors
+ * Called after every batch of events. If they changed anything, the
+ * intervals go back to the configured ones, and the neighbors are told
+ * right away.
  */
-void send_path_vector_packets() {
+void reset_intervals() {
+  if(adaptive.seen_changes == fib.num_changes)
+    return;
+  adaptive.seen_changes = fib.num_changes;
+  adaptive.last_change = monotonic_time();
+  if(adaptive.max_factor == 1)
+    return;
 
-  /* Initialize packet with credentials */
-  Pv_packet p;
-  p.sender_PV_port = htonl(router.myPVport);
- 
-  Link_state_packet dp; Msg_packet mp; Ping_packet pp;
+  if(adaptive.flood_interval != FLOOD_INTERVAL * 1000) {
+    adaptive.flood_interval = FLOOD_INTERVAL * 1000;
+    set_timer_interval(adaptive.flood_fd, adaptive.flood_interval);
+  }
+  if(adaptive.hello_interval != router.hello_interval) {
+    adaptive.hello_interval = router.hello_interval;
+    set_timer_interval(adaptive.hello_fd, adaptive.hello_interval);
+    ping_neighbors();
+  }
+}
 
-  for(int i=0; i<router.num_neighbors; i++) {
-    /* If a session is set up, send a Path Vector packet */
-    if(router.neighbors[i].is_paired == TRUE) {
+/*
+ * Acknowledges a timerfd expiration, so that the fd stops being readable.
+ * Returns the number of periods that elapsed since the last read.
+ */
+uint64_t read_timer(int fd) {
+  uint64_t expirations = 0;
+  if(read(fd, &expirations, sizeof(expirations)) < 0)
+    return 0;
+  return expirations;
+}
+
+/*
+ * void
+ * handle_hello_timer
+ *
+ * Pings all the neighbors every adaptive.hello_interval milliseconds,
+ * backing off first if that is enabled and nothing changed.
+ */
+void handle_hello_timer(int fd) {
+  if(read_timer(fd) == 0)
+    return;
+
+  if(adaptive.max_factor > 1)
+    back_off_interval(&adaptive.hello_interval, router.hello_interval,
+                      MAX_HELLO_INTERVAL, fd);
+  ping_neighbors();
+}
+
+/*
+ * void
+ * handle_flood_timer
+ *
+ * Every adaptive.flood_interval milliseconds, sends the path vector
+ * updates, backing off first if that is enabled and nothing changed. Link
+ * state advertisements are only sent when they change.
+ */
+void handle_flood_timer(int fd) {
+  if(read_timer(fd) == 0)
+    return;
 
-      /* Set the key of the  connection */
-      for(int j=0; j<10; j++)
-        p.key[j] = htonl(router.neighbors[i].key[j]);
+  if(adaptive.max_factor > 1)
+    back_off_interval(&adaptive.flood_interval, FLOOD_INTERVAL * 1000,
+                      MAX_BACKOFF_FACTOR * FLOOD_INTERVAL * 1000, fd);
 
-      for(int j=0; j<20; j++) {
+  /* Send path vector updates to all peered border routers */
+  send_path_vector_packets();
+}
 
-        /* If there is some path to a given router */
-        if(router.routing_table[j][0] != UNSET) {
+/*
+ * void
+ * handle_refresh_timer
+ *
+ * Every LSA_REFRESH_INTERVAL seconds, advertises the neighbors of this
+ * router again, so that it doesn't age out of the other databases.
+ */
+void handle_refresh_timer(int fd) {
+  if(read_timer(fd) == 0)
+    return;
 
-          /* Set the destination of the path */
-          p.pv.dest = htonl(j);
+  originate_lsa(TRUE);
+}
 
-          /* 
-           * Set the first element of the path to itself, so that we
-           * don't have to worry about processing it at the other end.
-           */
-          p.pv.path[0] = htonl(router.id);
+/*
+ * void
+ * handle_expiry_timer
+ *
+ * When the next timer of the wheel is due, drops the neighbors and
+ * advertisements that have not been refreshed recently, and computes the
+ * routes if they are due. The hellos waiting in their queue are accounted
+ * for first, as the other control packets may be holding the event loop
+ * up. The timerfd is then armed again for the next timer.
+ */
+void handle_expiry_timer(int fd) {
+  if(read_timer(fd) == 0)
+    return;
 
-          int k;
+  timer_wheel.armed = UNSET;
+  drain_control_queue(&hello_queue, CONTROL_QUEUE_SIZE);
+  check_timestamps();
+  arm_expiry_timer(next_timer_tick());
+}
 
-          /* Copy the path over from the routing table */
-          for(k=0; k<20; k++) {
-            p.pv.path[k+1] = htonl(router.routing_table[j][k]);
+/*
+ * void
+ * handle_console
+ *
+ * Reads whatever was entered in the console and runs each complete line
+ * as a command. The fd is read directly (rather than through stdio), as
+ * buffered lines would otherwise never wake the event loop up. On EOF the
+ * console is removed from the event loop, so that it doesn't spin.
+ */
+void handle_console(int fd) {
+  static char buff[512];
+  static int used = 0;
+  int cc, start = 0;
+
+  cc = read(fd, buff + used, sizeof(buff) - used - 1);
+  if(cc <= 0) {
+    if(cc < 0 && errno == EINTR)
+      return;
+    remove_event_source(fd);
+    return;
+  }
+  used += cc;
+
+  /* Run every complete line */
+  for(int i=0; i<used; i++) {
+    if(buff[i] == '\n') {
+      buff[i] = '\0';
+      handle_stdin(buff + start);
+      start = i + 1;
+    }
+  }
 
-            /* Break when  we reach the destination */
-            if(router.routing_table[j][k] == j)
-              break;
-          }
+  /* Keep the partial line, or drop it if it can never fit */
+  used -= start;
+  memmove(buff, buff + start, used);
+  if(used == sizeof(buff) - 1)
+    used = 0;
+  fflush(stdout);
+}
 
-          send_one_packet(router.neighbors[i].port, PV, pp, mp, p, dp);
-        }
+/*
+ * void
+ * open_control_socket
+ *
+ * Listens on the control socket, replacing whatever was left at its path,
+ * and adds it to the event loop. Only the owner may connect to it: the
+ * socket file is created without any permission for others.
+ */
+void open_control_socket() {
+  struct sockaddr_un sun;
+  mode_t mask;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+  if(fd < 0) {
+    perror("open_control_socket: socket");
+    exit(1);
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  if(strlen(control_socket.path) >= sizeof(sun.sun_path)) {
+    printf("Control socket path too long.\n");
+    exit(1);
+  }
+  strcpy(sun.sun_path, control_socket.path);
+  unlink(control_socket.path);
+  mask = umask(0177);
+  if(bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+    perror("open_control_socket: bind");
+    exit(1);
+  }
+  umask(mask);
+  if(chmod(control_socket.path, 0600) < 0 || listen(fd, SOMAXCONN) < 0) {
+    perror("open_control_socket: listen");
+    exit(1);
+  }
+  add_event_source(fd, handle_control_socket);
+}
+
+/*
+ * void
+ * handle_control_socket
+ *
+ * Accepts the pending connections to the control socket, and adds them to
+ * the event loop. Connections from processes of another user than the
+ * router's, other than root, are closed straight away.
+ */
+void handle_control_socket(int fd) {
+  struct ucred peer;
+  socklen_t length;
+  int client;
+
+  while((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) >= 0 ||
+        errno == EINTR) {
+    if(client < 0)
+      continue;
+    length = sizeof(peer);
+    if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 ||
+       (peer.uid != getuid() && peer.uid != 0)) {
+      close(client);
+      continue;
+    }
+    grow_array((void **)&control_socket.clients, &control_socket.max_clients,
+               client + 1, sizeof(Control_client));
+    control_socket.clients[client].used = 0;
+    add_event_source(client, handle_control_client);
+  }
+  if(errno != EAGAIN && errno != EWOULDBLOCK)
+    perror("handle_control_socket: accept4");
+}
+
+/*
+ * void
+ * handle_control_client
+ *
+ * Reads what connection `fd` to the control socket sent. Once it is done
+ * sending, runs it as one batch, replies with the outcome and closes the
+ * connection. A connection never blocks the event loop: it is only read
+ * from while it has something to read.
+ */
+void handle_control_client(int fd) {
+  Control_client *client = &control_socket.clients[fd];
+  char reply[MAX_COMMAND * 2] = "";
+  int cc;
+
+  while(1) {
+    if(client->used + 1 >= client->max) {
+      if(client->max >= MAX_BATCH_SIZE) {
+        snprintf(reply, sizeof(reply), "Batch too large, nothing applied.\n");
+        break;
+      }
+      grow_array((void **)&client->buff, &client->max, client->used + 4096,
+                 sizeof(char));
+    }
+    cc = read(fd, client->buff + client->used, client->max - client->used - 1);
+    if(cc > 0)
+      client->used += cc;
+    else if(cc < 0 && errno == EINTR)
+      continue;
+    else if(cc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    else {
+      if(cc == 0) {
+        client->buff[client->used] = '\0';
+        run_batch(client->buff, reply, sizeof(reply));
       }
+      break;
     }
   }
+
+  if(write(fd, reply, strlen(reply)) < 0)
+    perror("handle_control_client: write");
+  remove_event_source(fd);
+  close(fd);
+  free(client->buff);
+  client->buff = NULL;
+  client->used = client->max = 0;
+  fflush(stdout);
 }
 
 /*
  * void
- * send_data_packets
+ * run_config_file
  *
- * Send data packets to all neighbors
+ * Runs the commands in file `name` as one batch.
  */
-void send_data_packets() {  
-  Link_state_packet p;
+void run_config_file(const char *name) {
+  char reply[MAX_COMMAND * 2];
+  char *text = read_file(name);
 
-  Pv_packet pvp; Ping_packet pp; Msg_packet mp;
-  /* set timestamp */
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  long current_time = now.tv_sec;
-  p.timestamp = htonl(current_time);
-
-  /* Set sender_LS_port and ID */
-  p.sender_LS_port = htonl(router.myLSport);
-  p.sender_id = htonl(router.id);
-
-  /* Set the seen by flags for all routers except this one to FALSE */
-  for(int i=0; i<20; i++)
-    p.seen_by[i] = htonl(FALSE);
-  p.seen_by[router.id] = htonl(TRUE);
-
-  /* Set the neighbors */
-  for(int i=0; i<router.num_neighbors; i++) {
-    p.neighbors[i].port = htonl(router.neighbors[i].port);
-    p.neighbors[i].last_seen = htonl(router.neighbors[i].last_seen);
-    p.neighbors[i].id = htonl(router.neighbors[i].id);
+  if(text == NULL) {
+    printf("Cannot read %s.\n\n", name);
+    return;
   }
-  p.num_neighbors = htonl(router.num_neighbors);
-
-  for(int i=0; i<router.num_neighbors; i++)
-    if(router.neighbors[i].is_paired == FALSE)
-      send_one_packet(router.neighbors[i].port, DATA, pp, mp, pvp, p);
-
+  run_batch(text, reply, sizeof(reply));
+  printf("%s\n", reply);
+  free(text);
 }
 
 /*
- * void
- * dijkstra
+ * char *
+ * read_file
  *
- * Runs Dijkstra's algorithm on all the nodes beginning with
- * `init`
+ * Returns the contents of file `name` as a string, to be freed, or NULL if
+ * it can't be read or is larger than MAX_BATCH_SIZE.
  */
-int dijkstra(int init) {
-
-  int dist[20];
-  int visited_nodes[20];
-  int previous[20];
-
-  /* set all the distances except from the initial node to MAX_INT */
-  for(int i=0; i<20; i++) {
-    dist[i] = MAX_INT;
-    visited_nodes[i] = FALSE;
-    previous[i] = -1;
+char *read_file(const char *name) {
+  char *text = NULL;
+  int used = 0, max = 0, cc;
+  int fd = open(name, O_RDONLY);
+
+  if(fd < 0)
+    return NULL;
+  do {
+    grow_array((void **)&text, &max, used + 4096, sizeof(char));
+    cc = read(fd, text + used, max - used - 1);
+    if(cc > 0)
+      used += cc;
+  } while((cc > 0 || (cc < 0 && errno == EINTR)) && used < MAX_BATCH_SIZE);
+  close(fd);
+
+  if(cc != 0) {
+    free(text);
+    return NULL;
   }
-  dist[init] = 0;
+  text[used] = '\0';
+  return text;
+}
 
-  int curr = init;
-  while(1) {
+/*
+ * int
+ * run_batch
+ *
+ * Runs the commands in `text`, one per line, as a batch: peering sessions
+ * (S), rejects (R), preferred paths (P) and policy rules (A). Empty lines
+ * and those starting with '#' are skipped. Either all of them are valid
+ * and run, or none is. The policy is applied once, after all of them, and
+ * the routes are computed once too, when the event loop gets back to it.
+ * Says how it went in `reply`, and returns SUCCESS or FAILURE.
+ */
+int run_batch(char *text, char *reply, int size) {
+  char **lines = NULL, *save, buff[MAX_COMMAND];
+  int num_lines = 0, max_lines = 0, num_rules = 0, via[MAX_PATH];
+  Policy_rule rule;
+
+  for(char *line = strtok_r(text, "\n", &save); line != NULL;
+      line = strtok_r(NULL, "\n", &save)) {
+    line[strcspn(line, "\r")] = '\0';
+    if(line[0] == '\0' || line[0] == '#')
+      continue;
+    grow_array((void **)&lines, &max_lines, num_lines + 1, sizeof(char *));
+    lines[num_lines++] = line;
+  }
 
-    /* Mark current node as visited */
-    visited_nodes[curr] = TRUE;
-
-    /* For each of the neighbors of current node which are alive */
-    for(int i=0; i<20; i++) {
-      if((router.network_matrix[curr][i] != 0) && 
-         (router.network_matrix[i][curr] != 0)) {
-        /* 
-				 * check if new path is cheaper than old path, if so update the 
-				 * distance 
-				 */ 
-        int new_dist = dist[curr] + 1;
-        if(new_dist < dist[i]) {
-          dist[i] = new_dist;
-          previous[i] = curr;
-        }
-      }
+  /* Check them all before running any */
+  for(int i=0; i<num_lines; i++) {
+    if(check_command(lines[i]) != SUCCESS) {
+      snprintf(reply, size, "Command %d is invalid, nothing applied: %.*s\n",
+               i + 1, MAX_COMMAND, lines[i]);
+      free(lines);
+      return FAILURE;
     }
-    int min_dist = MAX_INT;
-    int min_node = -1;
+  }
 
-    /* 
-		 * Check to see if there's an unvisited node, that has been reached from 
-		 * one of the nodes we've looked through
-		 */
-    for(int i=0; i<20; i++) {
-      if(visited_nodes[i] == FALSE) {
-        if(dist[i] < min_dist) {
-          min_dist = dist[i];
-          min_node = i;
-        }
-      }
+  for(int i=0; i<num_lines; i++) {
+    strcpy(buff, lines[i]);
+    if(buff[0] == 'A') {
+      parse_policy_rule(buff, &rule, via);
+      append_policy_rule(&rule);
+      num_rules++;
     }
-    /* If so, set the node with the least distance as current. */
-    if(min_node == -1)
-      break;
     else
-      curr = min_node;
+      handle_stdin(buff);
   }
+  if(num_rules > 0)
+    apply_policy();
 
-  int prev;
-	/* 
-	 * Look through each of the distances we have calculated, and
-	 * update the routing table appropriately.
-	 */
-  for(int i=0; i<20; i++) {
-		/* If the node was reachable and is not itself */
-    if((dist[i] != MAX_INT) &&
-       (dist[i] != 0) &&
-       (router.is_preferred[i] != TRUE) &&
-       (router.uses_path_vector[i] != TRUE)) {
-			/* calculate the path back to the initial node */
-      prev = i;
-      int path[dist[i]];
-      int counter = dist[i] - 1;
-      while(prev != init) {
-        router.routing_table[i][counter] = prev;
-        prev = previous[prev];
-        counter--;
-      }
-    } 
-    /* It was unreachable, hence reset the routing table */
-		else if(router.uses_path_vector[i] != TRUE)
-			router.routing_table[i][0] = UNSET;
-  }
+  snprintf(reply, size, "Batch applied: %d commands.\n", num_lines);
+  free(lines);
+  return SUCCESS;
 }
 
 /*
- * void
- * print_neighbors
+ * int
+ * check_command
  *
- * Print all neighbors of the current node per the format specified in
- * the spec.
+ * Returns SUCCESS if `line` is a command that can be part of a batch (see
+ * run_batch()), and would be accepted.
  */
-void print_neighbors() {
-    int router_id = router.id;
-    for(int i=0; i<20; i++) {
-      if(router.network_matrix[router_id][i] != 0)
-        printf("%d ", i);
-    }
-    printf("\n\n");
+int check_command(const char *line) {
+  char buff[MAX_COMMAND], key[MAX_COMMAND];
+  int id, port, path[MAX_PATH], path_length, via[MAX_PATH];
+  Policy_rule rule;
+
+  if(strlen(line) >= MAX_COMMAND || router.is_border_router == FALSE)
+    return FAILURE;
+  strcpy(buff, line);
+
+  switch(buff[0]) {
+    case 'S':
+      if(sscanf(buff, "S %d %d %79s", &id, &port, key) != 3 ||
+         strlen(key) >= sizeof(router.neighbors[0].key))
+        return FAILURE;
+      return (id >= 0 && id <= MAX_ROUTER_ID && port > 0 && port <= 65535) ?
+             SUCCESS : FAILURE;
+    case 'R':
+      if(sscanf(buff, "R %d", &id) != 1)
+        return FAILURE;
+      return (id >= 0 && id <= MAX_ROUTER_ID) ? SUCCESS : FAILURE;
+    case 'P':
+      return parse_prefer_policy(buff, path, &path_length);
+    case 'A':
+      return parse_policy_rule(buff, &rule, via);
+  }
+  return FAILURE;
 }
 
 /*
  * void
- * print_routing_table
+ * handle_socket
  *
- * Prints the routes to the reachable neighbors.
+ * Runs in the forwarding thread. Drains up to BATCH_SIZE packets received
+ * on either of the ports (path vector, or link state): messages are
+ * forwarded right away, everything else is queued for the control thread,
+ * hellos apart from the rest.
  */
-void print_routing_table() {
+void handle_socket(int fd) {
+  int n = batch_recv(&rx_batch, fd), queued = FALSE;
 
-  dijkstra(router.id);
+  if(n < 0){
+    perror("pa-one-recv: recvmmsg");
+    exit(1);
+  }
 
-	for(int i=0; i<20; i++) {
-		if(router.routing_table[i][0] != UNSET)
-			for(int j=0; j<20; j++) {
-				printf("%d ", router.routing_table[i][j]);
-				if(router.routing_table[i][j] == i) {
-					printf("\n");
-					break;
-				}
-			}
+  for(int i=0; i<n; i++) {
+    char *buff = batch_data(&rx_batch, i);
+    int cc = batch_length(&rx_batch, i), type = wire_peek_type(buff, cc);
+    if(type == MSG) {
+      Msg_packet p;
+      if(decode_msg_packet(buff, cc, &p) == SUCCESS)
+        process_msg_packet(&p);
+      continue;
+    }
+    if(type != PING)
+      stamp_keepalive(buff, cc, type);
+    if(queue_control_packet((type == PING) ? &hello_queue :
+                            &control_queue, buff, cc) == TRUE)
+      queued = TRUE;
   }
-  printf("\n");
+
+  flush_packets();
+
+  /* Wake the control thread up */
+  if(queued == TRUE) {
+    uint64_t one = 1;
+    if(write(control_queue.event_fd, &one, sizeof(one)) < 0)
+      perror("handle_socket: write");
+  }
+  fflush(stdout);
 }
 
 /*
- * If a given packet was of type PING, we can be sure that is from one of the
- * router's neighbors. So, simply update the last seen of that neighbor, and
- * don't forward the packet
+ * void
+ * init_control_queue
+ *
+ * Allocates the slots of `queue`, which is signalled through `event_fd`.
  */
-void process_ping_packet(Ping_packet p) {
-  int sender_id, sender_LS_port, sender_PV_port;
-  long int timestamp;
-
-  /* Get all the values stored in the packet */
-  sender_id = ntohl(p.sender_id);
+void init_control_queue(Control_queue *queue, int event_fd) {
+  queue->slots = malloc((size_t)CONTROL_QUEUE_SIZE * RECV_BUFFER_SIZE);
+  queue->lengths = malloc(CONTROL_QUEUE_SIZE * sizeof(int));
+  queue->event_fd = event_fd;
+  if(queue->slots == NULL || queue->lengths == NULL || event_fd < 0) {
+    perror("init_control_queue");
+    exit(1);
+  }
+}
 
-  /* Drop if the id is one that we have rejected */
-  if(router.is_rejected[sender_id] == TRUE)
-    return;
+/*
+ * int
+ * queue_control_packet
+ *
+ * Runs in the forwarding thread. Copies a packet of `cc` bytes into
+ * `queue`, and returns TRUE, or FALSE if the queue was full.
+ */
+int queue_control_packet(Control_queue *queue, const char *buff, int cc) {
+  unsigned int head = queue->head;
+  unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  int slot = head & (CONTROL_QUEUE_SIZE - 1);
+
+  if(head - tail == CONTROL_QUEUE_SIZE) {
+    __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+    return FALSE;
+  }
 
-  sender_LS_port = ntohl(p.sender_LS_port);
-  sender_PV_port = ntohl(p.sender_PV_port);
-  timestamp = ntohl(p.timestamp);
+  memcpy(queue->slots + (size_t)slot * RECV_BUFFER_SIZE, buff, cc);
+  queue->lengths[slot] = cc;
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return TRUE;
+}
 
-  /* Update the last seen for that neighbor */
-  int num_neighbors = router.num_neighbors;
-  for(int i=0; i < num_neighbors; i++) {
-    if((router.neighbors[i].port == sender_LS_port) ||
-       ((router.neighbors[i].port == sender_PV_port) && 
-        (router.neighbors[i].is_paired == TRUE))) {
-      router.neighbors[i].last_seen = timestamp;
-      router.neighbors[i].id = sender_id;
-      /* Update the network adjacency matrix */
-      router.network_matrix[router.id][sender_id] = timestamp;
-      router.network_matrix[sender_id][router.id] = timestamp;
-      break;
-    }
+/*
+ * int
+ * drain_control_queue
+ *
+ * Runs in the control thread. Processes up to `budget` of the packets in
+ * `queue`, and hands their slots back. Returns TRUE if some are left.
+ */
+int drain_control_queue(Control_queue *queue, int budget) {
+  unsigned int head, tail = queue->tail;
+
+  head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  for(; tail != head && budget > 0; tail++, budget--) {
+    int slot = tail & (CONTROL_QUEUE_SIZE - 1);
+    process_packet(queue->slots + (size_t)slot * RECV_BUFFER_SIZE,
+                   queue->lengths[slot]);
   }
 
+  /* Forwarded packets point into the slots, send them before handing back */
+  flush_packets();
+  __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+  return (tail != head);
 }
 
 /*
- * If a given packet is of type MSG, if this router is not the destination
- * of the message, send it along its path
+ * void
+ * handle_control_queue
+ *
+ * Runs in the control thread. Processes the packets queued by the
+ * forwarding thread: all the hellos, then up to CONTROL_BUDGET of the
+ * others. If more are left, the eventfd is signalled again, so that they
+ * are processed after the timers that went off in the meantime. The
+ * routes learned from them are computed once the throttle allows it.
  */
-void process_msg_packet(Msg_packet p) {
-  int dest;
-  dest = ntohl(p.dest);
+void handle_control_queue(int fd) {
+  uint64_t count, one = 1;
 
-  /* Make sure the destination is a valid id */
-  if((dest < 0) || (dest > 19)) {
-    printf("Invalid destination.\n");
+  /* Reset the eventfd first, so that no later packet is missed */
+  if(read(fd, &count, sizeof(count)) < 0)
     return;
-  }
 
-  /* If this router is the destinatioon of the msg, just return */
-  if(dest == router.id)
-      return;
- 
-  send_msg(dest);
+  drain_control_queue(&hello_queue, CONTROL_QUEUE_SIZE);
+  if(drain_control_queue(&control_queue, CONTROL_BUDGET) == TRUE)
+    if(write(fd, &one, sizeof(one)) < 0)
+      perror("handle_control_queue: write");
+  fflush(stdout);
 }
 
 /*
- * void
- * process_pv_packet
+ * int
+ * encode_ping_packet
  *
- * Process path vector packet and update routing table 
+ * Encodes `p` into the `size` bytes at `buff`. Returns the length of the
+ * packet, or FAILURE if it doesn't fit. The same goes for the other
+ * encode_*_packet() functions.
  */
-void process_pv_packet(Pv_packet p) {
-  
-  int sender_PV_port, dest;
-  long int timestamp;
-
-  char key[10];
-  
-  /* Get credentials from packet */
-  sender_PV_port = ntohl(p.sender_PV_port);
-  dest = ntohl(p.pv.dest);
+int encode_ping_packet(const Ping_packet *p, void *buff, int size) {
+  Wire w;
+
+  wire_begin(&w, buff, size, PING);
+  wire_put_varint(&w, p->sender_id);
+  wire_put_varint(&w, p->sender_LS_port);
+  wire_put_varint(&w, p->sender_PV_port);
+  wire_put_varint(&w, p->interval);
+  wire_put_varint(&w, p->detect_multiplier);
+  return wire_end(&w);
+}
 
-  for(int i=0; i<10; i++)
-    key[i] = ntohl(p.key[i]);
+/*
+ * int
+ * decode_ping_packet
+ *
+ * Decodes the `cc` byte packet at `buff` into `p`. Returns FAILURE if it
+ * is truncated or malformed, SUCCESS otherwise. The same goes for the
+ * other decode_*_packet() functions.
+ */
+int decode_ping_packet(char *buff, int cc, Ping_packet *p) {
+  Wire w;
 
-  int valid = FALSE;
+  if(wire_open(&w, buff, cc) != PING)
+    return FAILURE;
+  p->sender_id = wire_get_int(&w);
+  p->sender_LS_port = wire_get_int(&w);
+  p->sender_PV_port = wire_get_int(&w);
+  p->interval = wire_get_int(&w);
+  p->detect_multiplier = wire_get_int(&w);
+  return (w.error == TRUE) ? FAILURE : SUCCESS;
+}
 
-  /* Ensure that the packet is from a paired neighbor */
-  for(int i=0; i<router.num_neighbors; i++) {
-    if((router.neighbors[i].port == sender_PV_port) &&
-       (router.neighbors[i].is_paired == TRUE)) {
+int encode_msg_packet(const Msg_packet *p, void *buff, int size) {
+  Wire w;
 
-      if(strncmp(key, router.neighbors[i].key, 10) == 0)
-        valid = TRUE;
-     }
-   }
-   if(valid == FALSE)
-     return;
+  wire_begin(&w, buff, size, MSG);
+  wire_put_varint(&w, p->dest);
+  wire_put_varint(&w, p->tunnel + 1);
+  wire_put_varint(&w, p->flow);
+  return wire_end(&w);
+}
 
-  /* If the destination is this router itself, drop it */
-  if(dest == router.id)
-    return;
+int decode_msg_packet(char *buff, int cc, Msg_packet *p) {
+  Wire w;
 
-  /* Don't bother if you already have a preferred path */
-  if(router.is_preferred[dest])
-    return;
+  if(wire_open(&w, buff, cc) != MSG)
+    return FAILURE;
+  p->dest = wire_get_int(&w);
+  p->tunnel = wire_get_int(&w) - 1;
+  p->flow = wire_get_int(&w);
+  if(p->tunnel > MAX_ROUTER_ID)
+    return FAILURE;
+  return (w.error == TRUE) ? FAILURE : SUCCESS;
+}
 
-  /* Get the advertised_path from the packet */
-  int advertised_path[20];
-  for(int i=0; i<20; i++)
-    advertised_path[i] = ntohl(p.pv.path[i]);
-
-  /* Get the length of the current path */
-  int current_path_length = 0;
-  if(router.routing_table[dest][0] != UNSET) {
-    for(int i=0; i<20; i++) {
-      current_path_length++;
-      if(router.routing_table[dest][i] == dest)
-        break;
-    }
-  }
-  
-  /* Get the length of the advertised path */
-  int advertised_path_length = 0;
-  for(int i=0; i<20; i++) {
-    advertised_path_length++;
-    if(advertised_path[i] == dest)
-      break;
-    else
-      continue;
+/*
+ * The key is sent as its length, followed by its characters. The
+ * withdrawals and the routes are each preceded by their number.
+ */
+int encode_pv_packet(const Pv_packet *p, void *buff, int size) {
+  int key_length = strnlen(p->key, sizeof(p->key));
+  Wire w;
+
+  wire_begin(&w, buff, size, PV);
+  wire_put_varint(&w, key_length);
+  wire_put_bytes(&w, p->key, key_length);
+  wire_put_varint(&w, p->sender_PV_port);
+  wire_put_varint(&w, p->flags);
+  wire_put_varint(&w, p->num_withdrawn);
+  for(int i=0; i<p->num_withdrawn; i++)
+    wire_put_varint(&w, p->withdrawn[i]);
+  wire_put_varint(&w, p->num_routes);
+  for(int i=0; i<p->num_routes; i++) {
+    const struct Path_vector *pv = &p->routes[i];
+    wire_put_varint(&w, pv->dest);
+    wire_put_varint(&w, pv->length);
+    for(int k=0; k<pv->length; k++)
+      wire_put_varint(&w, pv->path[k]);
   }
+  return wire_end(&w);
+}
 
-  /* Don't bother if the current length is smaller */
-  if((router.uses_path_vector[dest] != FALSE) &&
-     ((current_path_length <= advertised_path_length) &&
-     (current_path_length != 0)))
-    return;
+int decode_pv_packet(char *buff, int cc, Pv_packet *p) {
+  int key_length;
+  Wire w;
 
-  /* Ensure that none of the rejected routers on the path */
-  for(int i=0; i<20; i++) {
-    int hop = advertised_path[i];
-    if(router.is_rejected[hop] == TRUE)
-      return;
-    if(hop == dest)
-      break;
+  if(wire_open(&w, buff, cc) != PV)
+    return FAILURE;
+  memset(p->key, 0, sizeof(p->key));
+  key_length = wire_get_int(&w);
+  if(key_length > (int)sizeof(p->key))
+    return FAILURE;
+  wire_get_bytes(&w, p->key, key_length);
+  p->sender_PV_port = wire_get_int(&w);
+  p->flags = wire_get_int(&w);
+  p->num_withdrawn = wire_get_int(&w);
+  if(p->num_withdrawn > MAX_PV_WITHDRAWN)
+    return FAILURE;
+  for(int i=0; i<p->num_withdrawn; i++)
+    p->withdrawn[i] = wire_get_int(&w);
+  p->num_routes = wire_get_int(&w);
+  if(p->num_routes > MAX_PV_ROUTES)
+    return FAILURE;
+  for(int i=0; i<p->num_routes && w.error == FALSE; i++) {
+    struct Path_vector *pv = &p->routes[i];
+    pv->dest = wire_get_int(&w);
+    pv->length = wire_get_int(&w);
+    if(pv->length > MAX_PATH)
+      return FAILURE;
+    for(int k=0; k<pv->length; k++)
+      pv->path[k] = wire_get_int(&w);
   }
+  return (w.error == TRUE) ? FAILURE : SUCCESS;
+}
 
-  /* Set the uses_path_vector for that dest to be true */
-  router.uses_path_vector[dest] = timestamp;
-
-  /* Actually copy it all over */
-  for(int i=0; i < advertised_path_length; i++) {
-    router.routing_table[dest][i] = advertised_path[i];
+int encode_link_state_packet(const Link_state_packet *p, void *buff, int size) {
+  Wire w;
+
+  wire_begin(&w, buff, size, DATA);
+  wire_put_u32(&w, p->relayed_by);
+  wire_put_varint(&w, p->sender_id);
+  wire_put_varint(&w, p->sequence);
+  wire_put_varint(&w, p->sender_LS_port);
+  wire_put_varint(&w, p->num_neighbors);
+  for(int i=0; i<p->num_neighbors; i++) {
+    wire_put_varint(&w, p->neighbors[i].id);
+    wire_put_varint(&w, p->neighbors[i].cost);
   }
+  return wire_end(&w);
+}
 
-  return;
+/*
+ * `p` keeps pointing to the packet at `buff`, so it can be flooded on.
+ */
+int decode_link_state_packet(char *buff, int cc, Link_state_packet *p) {
+  uint64_t sequence;
+  Wire w;
+
+  if(wire_open(&w, buff, cc) != DATA)
+    return FAILURE;
+  p->relayed_by = (int)wire_get_u32(&w);
+  p->sender_id = wire_get_int(&w);
+  sequence = wire_get_varint(&w);
+  p->sequence = (unsigned int)sequence;
+  p->sender_LS_port = wire_get_int(&w);
+  p->num_neighbors = wire_get_int(&w);
+  if(sequence > UINT_MAX || p->num_neighbors > MAX_LSA_NEIGHBORS)
+    return FAILURE;
+  for(int i=0; i<p->num_neighbors; i++) {
+    p->neighbors[i].id = wire_get_int(&w);
+    p->neighbors[i].cost = wire_get_int(&w);
+  }
+  p->buff = buff;
+  p->cc = w.size;
+  return (w.error == TRUE) ? FAILURE : SUCCESS;
 }
 
 /*
  * void
- * process_link_state_packet
+ * process_packet
  *
- * Process link state packet and update the network_matrix
+ * Decodes a received packet of `cc` bytes based on the type in its header,
+ * and processes it.
  */
-void process_link_state_packet(Link_state_packet p) {
-  int seen_by[20], sender_LS_port, sender_id, num_neighbors;
-  long int timestamp;
-  Neighbor neighbors[20];
-  
-  /* Get current time */
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  long int current_time = now.tv_sec;
-
-  /* Get time stamp, and if the packet is really old, drop it */
-  timestamp = ntohl(p.timestamp);
-  sender_LS_port = ntohl(p.sender_LS_port);
-  sender_id = ntohl(p.sender_id);
-
-  if(router.is_rejected[sender_id] == TRUE)
-    return;
-
-  /* If the packet is really old, drop it */
-  if((current_time - timestamp) > (NEIGHBOR_LAG + 3))
-    return;
-
-  /* Get the number of neighbors */
-  num_neighbors = ntohl(p.num_neighbors);
-
-  /* Get all the neighbors */
-  for(int i=0; i<num_neighbors; i++) {
-    neighbors[i].id = ntohl(p.neighbors[i].id);
-    neighbors[i].port = ntohl(p.neighbors[i].port);
-    neighbors[i].last_seen = ntohl(p.neighbors[i].last_seen);
+void process_packet(char *buff, int cc) {
+  Link_state_packet lsa;
+  Ping_packet ping;
+  Msg_packet msg;
+  Pv_packet pv;
+  int is_valid = FALSE;
+
+  switch(wire_peek_type(buff, cc)) {
+    case PING:
+      if((is_valid = (decode_ping_packet(buff, cc, &ping) == SUCCESS)))
+        process_ping_packet(&ping);
+      break;
+    case MSG:
+      if((is_valid = (decode_msg_packet(buff, cc, &msg) == SUCCESS)))
+        process_msg_packet(&msg);
+      break;
+    case PV:
+      if((is_valid = (decode_pv_packet(buff, cc, &pv) == SUCCESS)))
+        process_pv_packet(&pv);
+      break;
+    case DATA:
+      if((is_valid = (decode_link_state_packet(buff, cc, &lsa) == SUCCESS)))
+        process_link_state_packet(&lsa);
+      break;
   }
 
-  /* Update the network_matrix to the last time the neighbors were seen */
-  for(int i=0; i<num_neighbors; i++) {
-    if(neighbors[i].id != UNSET) {
-      router.network_matrix[sender_id][neighbors[i].id] = neighbors[i].last_seen;
-      router.network_matrix[neighbors[i].id][sender_id] = neighbors[i].last_seen;
-    }
-  }
+  if(is_valid == FALSE)
+    printf("  The packet of length %d, is malformed.\n", cc);
+}
 
-  /* Get a list of who all have seen the router, and forward */
-  for(int i=0; i<20; i++)
-    seen_by[i] = ntohl(p.seen_by[i]);
+/*
+ * void *
+ * forwarding_thread
+ *
+ * The forwarding plane: waits on the sockets registered with the epoll
+ * instance `arg`, and handles the packets they receive. It never blocks
+ * on the control thread. Forwarding tables are only looked up while the
+ * epoch is odd; moving it to even before waiting tells the control thread
+ * that no table is in use anymore.
+ */
+void *forwarding_thread(void *arg) {
+  struct epoll_event events[MAX_EVENTS];
+  int forwarding_epoll_fd = (int)(intptr_t)arg, n;
 
-  for(int i=0; i<router.num_neighbors; i++) {
-    int neighbor_port = router.neighbors[i].port;
-    int neighbor_id = router.neighbors[i].id;
+  init_sender();
 
-    /* If it has been seen by this neighbor, skip it */
-    if(seen_by[neighbor_id] == TRUE)
-      continue;
-    else {
-      /* Mark as seen by this router */
-      p.seen_by[router.id] = htonl(TRUE);
+  while(1) {
+    __atomic_add_fetch(&forwarding_epoch, 1, __ATOMIC_SEQ_CST);
+    n = epoll_wait(forwarding_epoll_fd, events, MAX_EVENTS, -1);
+    __atomic_add_fetch(&forwarding_epoch, 1, __ATOMIC_SEQ_CST);
 
-      /* Create empty packets, and send_one_packet */
-      Ping_packet pp; Msg_packet mp; Pv_packet pvp;
-      send_one_packet(neighbor_port, DATA, pp, mp, pvp, p);
+    /* If there was an error waiting */
+    if(n < 0){
+      if(errno == EINTR)
+        continue;
+      perror("forwarding_thread: epoll_wait");
+      exit(1);
     }
+
+    for(int i=0; i<n; i++)
+      handle_socket(events[i].data.fd);
   }
 
-  return;
+  return NULL;
 }
 
 /*
  * void
  * recv_and_handle
  *
- * Receives, and handles packets received on the link-state port
- * and the path vector port (if it is a border router)
+ * Binds the link-state port and the path vector port (if it is a border
+ * router), hands them to the forwarding thread, and runs the control
+ * thread's event loop: the packets queued by the forwarding thread,
+ * console input and the hello, flood and expiry timers are all dispatched
+ * from a single epoll instance, so that the periodic work runs on time
+ * regardless of the packet rate. Route computations only ever delay the
+ * control thread; messages keep being forwarded with the last table.
  *
- * A lot of the code below is from the example pa-one-recv.c file.
+ * A lot of the socket code below is from the example pa-one-recv.c file.
  */
 void recv_and_handle() {
-  fd_set mask;
+  struct epoll_event ev, events[MAX_EVENTS];
+  int n, s[2], forwarding_epoll_fd;
+  struct sockaddr_in sin;
+  pthread_t thread;
 
-  char recv_buffer[700];
+  epoll_fd = epoll_create1(0);
+  forwarding_epoll_fd = epoll_create1(0);
+  if(epoll_fd < 0 || forwarding_epoll_fd < 0) {
+    perror("recv_and_handle: epoll_create1");
+    exit(1);
+  }
 
-  char buff[512];
-  int n, id, s[2], len, isBound=0, cc;
-  struct sockaddr_in sin;
-  struct timeval tv;
+  if(batch_init(&rx_batch, BATCH_SIZE, RECV_BUFFER_SIZE) != SUCCESS)
+    exit(1);
+  init_sender();
+
+  /* The rings of control packets, and the eventfd signalling both */
+  init_control_queue(&control_queue, eventfd(0, EFD_NONBLOCK));
+  init_control_queue(&hello_queue, control_queue.event_fd);
+  keepalives.by_id = calloc(MAX_ROUTER_ID + 1, sizeof(long int));
+  keepalives.by_port = calloc(0x10000, sizeof(long int));
+  if(keepalives.by_id == NULL || keepalives.by_port == NULL) {
+    perror("recv_and_handle: calloc");
+    exit(1);
+  }
 
   /* Initialize the sockets */
   for(int i=0; i<2; i++) {
@@ -1012,114 +5761,100 @@ void recv_and_handle() {
     exit(1);
   }
 
-  /* Set the initial timeouts */
-  tv.tv_sec = TIMEOUT;
-  tv.tv_usec = 0;
-
-  while(1){
-
-    /* Check the time stamps on the network matrix */
-    check_timestamps();
-
-  
-    FD_ZERO(&mask);
-    FD_SET(fileno(stdin), &mask);
+  /* Only the forwarding thread reads from the bound sockets */
+  for(int i=(router.is_border_router ? 0 : 1); i<2; i++) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = s[i];
+    if(epoll_ctl(forwarding_epoll_fd, EPOLL_CTL_ADD, s[i], &ev) < 0) {
+      perror("recv_and_handle: epoll_ctl");
+      exit(1);
+    }
+  }
 
-    /* Reset flags */
-    for(int i=0; i<2; i++)
-      FD_SET(s[i], &mask);
+  /* The control packets, the console, and the periodic timers */
+  add_event_source(control_queue.event_fd, handle_control_queue);
+  add_event_source(fileno(stdin), handle_console);
+  if(control_socket.path != NULL)
+    open_control_socket();
+  adaptive.hello_interval = router.hello_interval;
+  adaptive.hello_fd = create_timer(adaptive.hello_interval);
+  adaptive.flood_fd = create_timer(adaptive.flood_interval);
+  add_event_source(adaptive.hello_fd, handle_hello_timer);
+  add_event_source(adaptive.flood_fd, handle_flood_timer);
+  timer_wheel.fd = create_timer(0);
+  add_event_source(timer_wheel.fd, handle_expiry_timer);
+  arm_expiry_timer(next_timer_tick());
+  add_event_source(create_timer(LSA_REFRESH_INTERVAL * 1000L),
+                   handle_refresh_timer);
+
+  /* Publish a first forwarding table, then start forwarding */
+  spf_throttle.timer = new_timer(SPF_TIMER, 0);
+  update_fib();
+  if(pthread_create(&thread, NULL, forwarding_thread,
+                    (void *)(intptr_t)forwarding_epoll_fd) != 0) {
+    perror("recv_and_handle: pthread_create");
+    exit(1);
+  }
 
-    /* Select the highest socket file descriptor */
-    n = select(s[1]+1, &mask, (fd_set*)0, (fd_set*)0, &tv);
+  while(1){
+    n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
 
-    /* If there was an error selecting */
+    /* If there was an error waiting */
     if(n < 0){
-      perror("select");
+      if(errno == EINTR)
+        continue;
+      perror("epoll_wait");
       exit(1);
     }
 
-    /* On time out */
-    if(n == 0){
-
-      /* Update `tv` back to TIMEOUT */
-      tv.tv_sec = TIMEOUT;
-      tv.tv_usec = 0;
+    for(int i=0; i<n; i++) {
+      Event_source *source = events[i].data.ptr;
+      source->handle(source->fd);
+    }
 
-      /* Ping all the neighbors */
-      ping_neighbors();
+    /* Whatever the handlers changed is routed around in one go */
+    schedule_spf();
+    reset_intervals();
 
-      /* Send path vector updates to all peered border routers */
-      send_path_vector_packets();
+    /* Send everything the handlers queued up with one sendmmsg() */
+    flush_packets();
+  }
+}
 
-      /* Send the data packets w/ all the neighbors to all neighbors */
-      send_data_packets();
- 
-      dijkstra(router.id);
-      continue;
-    }
 
-    /* If some text was entered in the console */
-    if(FD_ISSET(fileno(stdin), &mask)) {
-      fgets(buff, sizeof(buff), stdin);
-      handle_stdin(buff);
-    }
+/*
+ * void
+ * send_packet
+ *
+ * Queues an already encoded packet of `len` bytes to `port`. The buffer is
+ * referenced, not copied, so it has to stay untouched until flush_packets()
+ * runs at the end of the current event loop iteration.
+ */
+void send_packet(int port, const void *buff, int len) {
 
-    /* If either of the ports (path vector, or link state) received a packet */
-    for(int i=0; i<2; i++) {
-      if(FD_ISSET(s[i], &mask)) {
-        len = sizeof(sin);
+  /* Set the port of the header to the passed port */
+  sender_sin.sin_port = htons(port);
 
-        /* Receive and store in the recv_buffer */
-        cc = recvfrom(s[i], &recv_buffer, sizeof(recv_buffer), 0,
-                      (struct sockaddr *)&sin, &len);
+  if(sender_socket < 0){
+    perror("pa-one-send: socket");
+    exit(1);
+  }
 
-        if(cc < 0){
-          perror("pa-one-recv: recvfrom");
-          exit(1);
-        }
-        /* Based on the size of the packet, process it accordingly */
-        if(cc == sizeof(Ping_packet)){
-          Ping_packet p;
-          memcpy(&p, recv_buffer, sizeof(p));
-          process_ping_packet(p);
-        }
-        else if(cc == sizeof(Msg_packet)) {
-          Msg_packet p;
-          memcpy(&p, recv_buffer, sizeof(p));
-          process_msg_packet(p);
-        }
-        else if(cc == sizeof(Pv_packet)) {
-          Pv_packet p;
-          memcpy(&p, recv_buffer, sizeof(p));
-          process_pv_packet(p);
-        }
-        else if(cc == sizeof(Link_state_packet)) {
-          Link_state_packet p;
-          memcpy(&p, recv_buffer, sizeof(p));
-          process_link_state_packet(p);
-        }
-        else {
-          printf("  The length %d, is wrong.\n", cc);
-        }
-        fflush(stdout);
-      }
-    }
+  if(batch_send_ref(&tx_batch, sender_socket, &sender_sin, buff, len) < 0) {
+    perror("pa-one-send: sendmmsg");
+    exit(-1);
   }
 }
 
-
 /*
  * void
- * send_one_packet
+ * send_packet_copy
  *
- * Sends a packet of type `packet_type` to `port`
+ * Same as send_packet(), for packets built on the stack: `buff` is copied
+ * into the send queue, so it can be reused right away.
  */
-void send_one_packet(int port,
-                     int packet_type,
-                     Ping_packet pp,
-                     Msg_packet mp,
-                     Pv_packet pvp, 
-                     Link_state_packet dp) {
+void send_packet_copy(int port, const void *buff, int len) {
 
   /* Set the port of the header to the passed port */
   sender_sin.sin_port = htons(port);
@@ -1129,35 +5864,25 @@ void send_one_packet(int port,
     exit(1);
   }
 
-  /* Based on the packet_type, send the packet */
-  switch(packet_type) {
-    case PING:
-      if(sendto(sender_socket, &pp, sizeof(pp), 0,
-               (struct sockaddr *)&sender_sin, sizeof(sender_sin)) < 0) {
-        perror("pa-one-send: ping");
-        exit(-1);
-      }
-      break;
-    case MSG:
-      if(sendto(sender_socket, &mp, sizeof(mp), 0, (struct sockaddr *)&sender_sin, sizeof(sender_sin)) < 0){
-        perror("pa-one-send: msg");
-        exit(-1);
-      }
-      break;
+  if(batch_send(&tx_batch, sender_socket, &sender_sin, buff, len) < 0) {
+    perror("pa-one-send: sendmmsg");
+    exit(-1);
+  }
+}
 
-    case PV:
-      if(sendto(sender_socket, &pvp, sizeof(pvp), 0, (struct sockaddr *)&sender_sin, sizeof(sender_sin)) < 0){
-        perror("pa-one-send: path-vector");
-        exit(-1);
-      }
-      break;
+/*
+ * void
+ * flush_packets
+ *
+ * Sends all the queued packets with a single sendmmsg()
+ */
+void flush_packets() {
+  if(tx_batch.count == 0)
+    return;
 
-    case DATA:
-      if(sendto(sender_socket, &dp, sizeof(dp), 0, (struct sockaddr *)&sender_sin, sizeof(sender_sin)) < 0){
-        perror("pa-one-send: data-packet");
-        exit(-1);
-      }
-      break;
+  if(batch_flush(&tx_batch, sender_socket) < 0) {
+    perror("pa-one-send: sendmmsg");
+    exit(-1);
   }
 }
 
@@ -1166,6 +5891,8 @@ int main(int argc, char **argv) {
     printf("Error: enter valid arguments.\n");
     printf("Usage:\n./router ID myLSport port1 [port2 ...], OR\n");
     printf("./router -b myPVport ID myLSport port1 [port2 ...]\n");
+    printf("Options: -i hello interval (ms), -d detect multiplier, ");
+    printf("-a backoff factor, -c control socket path\n");
     exit(-1);
   }
 
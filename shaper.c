@@ -9,6 +9,8 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include "batch_io.h"
+
 #define SUCCESS 0
 #define FAILURE -1
 
@@ -58,9 +60,14 @@ Shaper shaper;
 struct sockaddr_in sin_sender;
 int sender_socket;
 
+/* Packets received per wakeup, and shaped packets waiting to be sent */
+Batch rx_batch;
+Batch tx_batch;
+
 int initialize(int argc, char **argv);
+void flush_packets();
 void print_shaper();
-void send_one_packet(int port, Packet p);
+void send_one_packet(int port, char *p);
 void shape();
 
 /*
@@ -86,6 +93,11 @@ int initialize(int argc, char **argv) {
   /* Initialize global var sender_socket */
   sender_socket = socket(AF_INET, SOCK_DGRAM, 0);
 
+  /* Initialize the batches used to receive and send packets */
+  if(batch_init(&rx_batch, BATCH_SIZE, sizeof(Packet)) != SUCCESS ||
+     batch_init(&tx_batch, BATCH_SIZE, sizeof(Packet)) != SUCCESS)
+    return FAILURE;
+
   /* Parse cmd line arguments and fill `shaper` */
   shaper.num_targets = 0;
 
@@ -138,14 +150,15 @@ void print_shaper() {
  * shape
  *
  * Listens and receives packet on the raw ports as specified in the cmd line.
- * Upon receiving packets, checks the token buckets, and forwards.
+ * Upon receiving packets, checks the token buckets, and forwards. Up to
+ * BATCH_SIZE packets are drained per port on each wakeup, and the shaped
+ * packets are all sent together at the end of it.
  *
  * A lot of the code below is from the example pa-one-recv.c file.
  */
 void shape() {
 
   fd_set mask;
-  Packet p;
   int n, id, s[10], len, isBound=0, cc;
   struct timeval tv;
 
@@ -205,33 +218,38 @@ void shape() {
     for(int i=0; i<num_targets; i++) {
       if(FD_ISSET(s[i], &mask)) {
 
-        len = sizeof(sin);
-
-        cc = recvfrom(s[i], &p, sizeof(p), 0,
-                      (struct sockaddr *)&sin, &len);
-        if(cc < 0){
-          perror("shape: recvfrom");
+        n = batch_recv(&rx_batch, s[i]);
+        if(n < 0){
+          perror("shape: recvmmsg");
           exit(1);
         }
 
-        if(cc == sizeof(p)){
-          /* 
-           * Check to see if tokens are available in the bucket. Update the
-           * number of tokens, and send forward to shaped port.
-           */
-          shaper.targets[i].tokens -= sizeof(p);
-          if(shaper.targets[i].tokens > 0) {
-            send_one_packet(shaper.targets[i].shaped_port, p);
-          }
-          else {
-            /* Drop packet */
+        for(int j=0; j<n; j++) {
+          cc = batch_length(&rx_batch, j);
+
+          if(cc == sizeof(Packet)){
+            /* 
+             * Check to see if tokens are available in the bucket. Update the
+             * number of tokens, and send forward to shaped port.
+             */
+            shaper.targets[i].tokens -= sizeof(Packet);
+            if(shaper.targets[i].tokens > 0) {
+              send_one_packet(shaper.targets[i].shaped_port,
+                              batch_data(&rx_batch, j));
+            }
+            else {
+              /* Drop packet */
+            }
+          } else {
+            printf("  The length is wrong.\n");
           }
-        } else {
-          printf("  The length is wrong.\n");
         }
         fflush(stdout);
       }
     }
+
+    /* Send everything that was let through with one sendmmsg() */
+    flush_packets();
   }
 }
 
@@ -239,9 +257,10 @@ void shape() {
  * void
  * send_one_packet
  *
- * send_one_packet sends a packet to the specified port on HOST
+ * send_one_packet queues a packet to the specified port on HOST. It is
+ * actually sent by flush_packets().
  */
-void send_one_packet(int port, Packet p) {
+void send_one_packet(int port, char *p) {
   sin_sender.sin_port = htons(port);
 
   if(sender_socket < 0){
@@ -249,8 +268,20 @@ void send_one_packet(int port, Packet p) {
     exit(1);
   }
 
-  if(sendto(sender_socket, &p, sizeof(p), 0, (struct sockaddr *)&sin_sender, sizeof(sin_sender)) < 0){
-    perror("send_one_packet: sendto");
+  if(batch_send(&tx_batch, sender_socket, &sin_sender, p, sizeof(Packet)) < 0){
+    perror("send_one_packet: sendmmsg");
+  }
+}
+
+/*
+ * void
+ * flush_packets
+ *
+ * Sends all the queued packets with a single sendmmsg()
+ */
+void flush_packets() {
+  if(batch_flush(&tx_batch, sender_socket) < 0){
+    perror("flush_packets: sendmmsg");
   }
 }
 
@@ -0,0 +1,734 @@
+/*
+ * Round-trip and malformed input tests for the wire format: the codec in
+ * wire.c, and the encode_*_packet() and decode_*_packet() functions of
+ * router.c, which is included here with its main() renamed. Built with
+ * the address sanitizer by `make test`, and every buffer handed to a
+ * decoder is allocated to its exact length, so that reading past the end
+ * of a packet fails the test.
+ */
+#define main router_main
+#include "../router.c"
+#undef main
+
+int num_checks = 0;
+int num_failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+void check(int cond, const char *text, const char *file, int line);
+char *copy_packet(const void *buff, int cc);
+int decode_copy(int type, const void *buff, int cc);
+void set_body_length(unsigned char *buff, int length);
+void test_varints(void);
+void test_fixed_width(void);
+void test_header(void);
+void test_ping_packet(void);
+void test_msg_packet(void);
+void test_pv_packet(void);
+void test_link_state_packet(void);
+void test_unknown_fields(void);
+void test_truncated(void);
+void test_limits(void);
+
+/*
+ * void
+ * check
+ *
+ * Counts a check, and reports it if `cond` is false.
+ */
+void check(int cond, const char *text, const char *file, int line) {
+  num_checks++;
+  if(cond == FALSE) {
+    num_failures++;
+    printf("%s:%d: check failed: %s\n", file, line, text);
+  }
+}
+
+/*
+ * char *
+ * copy_packet
+ *
+ * Returns a copy of the `cc` byte packet at `buff` in a buffer of exactly
+ * that size, so that the sanitizer catches any read past its end.
+ */
+char *copy_packet(const void *buff, int cc) {
+  char *copy = malloc(cc > 0 ? cc : 1);
+
+  if(copy == NULL) {
+    perror("copy_packet: malloc");
+    exit(1);
+  }
+  memcpy(copy, buff, cc);
+  return copy;
+}
+
+/*
+ * int
+ * decode_copy
+ *
+ * Decodes an exactly sized copy of the `cc` byte packet at `buff` as a
+ * packet of type `type`, and returns what the decoder did.
+ */
+int decode_copy(int type, const void *buff, int cc) {
+  char *copy = copy_packet(buff, cc);
+  Link_state_packet lsa;
+  Ping_packet ping;
+  Msg_packet msg;
+  Pv_packet pv;
+  int result = FAILURE;
+
+  switch(type) {
+    case PING: result = decode_ping_packet(copy, cc, &ping); break;
+    case MSG: result = decode_msg_packet(copy, cc, &msg); break;
+    case PV: result = decode_pv_packet(copy, cc, &pv); break;
+    case DATA: result = decode_link_state_packet(copy, cc, &lsa); break;
+  }
+  free(copy);
+  return result;
+}
+
+/*
+ * void
+ * set_body_length
+ *
+ * Overwrites the body length in the header of the packet at `buff`.
+ */
+void set_body_length(unsigned char *buff, int length) {
+  buff[2] = (unsigned char)(length >> 8);
+  buff[3] = (unsigned char)length;
+}
+
+void test_varints(void) {
+  uint64_t values[] = { 0, 1, 127, 128, 255, 300, 16383, 16384, 2097151,
+                        2097152, 268435455, 268435456, INT_MAX,
+                        (uint64_t)INT_MAX + 1, UINT32_MAX,
+                        (uint64_t)UINT32_MAX + 1, 34359738367ULL,
+                        34359738368ULL, (uint64_t)1 << 63, UINT64_MAX };
+  int num_values = sizeof(values) / sizeof(values[0]);
+  unsigned char buff[WIRE_MAX_VARINT];
+  Wire w;
+
+  for(int i=0; i<num_values; i++) {
+    /* Round trip, with the size wire_varint_size() announces */
+    w = (Wire){ buff, sizeof(buff), 0, FALSE };
+    wire_put_varint(&w, values[i]);
+    CHECK(w.error == FALSE);
+    CHECK(w.pos == wire_varint_size(values[i]));
+    int length = w.pos;
+    w = (Wire){ buff, length, 0, FALSE };
+    CHECK(wire_get_varint(&w) == values[i]);
+    CHECK(w.error == FALSE && w.pos == length);
+
+    /* A varint cut short anywhere is an error */
+    for(int k=0; k<length; k++) {
+      w = (Wire){ buff, k, 0, FALSE };
+      CHECK(wire_get_varint(&w) == 0 && w.error == TRUE);
+    }
+
+    /* Writing it needs room for all of it */
+    w = (Wire){ buff, length - 1, 0, FALSE };
+    wire_put_varint(&w, values[i]);
+    CHECK(w.error == TRUE && w.pos == 0);
+
+    /* Only the values that fit in an int are read as one */
+    w = (Wire){ buff, length, 0, FALSE };
+    int value = wire_get_int(&w);
+    if(values[i] <= INT_MAX)
+      CHECK(w.error == FALSE && value == (int)values[i]);
+    else
+      CHECK(w.error == TRUE && value == 0);
+  }
+
+  /* The encodings are LEB128 */
+  w = (Wire){ buff, sizeof(buff), 0, FALSE };
+  wire_put_varint(&w, 127);
+  CHECK(w.pos == 1 && buff[0] == 0x7f);
+  w = (Wire){ buff, sizeof(buff), 0, FALSE };
+  wire_put_varint(&w, 300);
+  CHECK(w.pos == 2 && buff[0] == 0xac && buff[1] == 0x02);
+  w = (Wire){ buff, sizeof(buff), 0, FALSE };
+  wire_put_varint(&w, UINT64_MAX);
+  CHECK(w.pos == WIRE_MAX_VARINT && buff[WIRE_MAX_VARINT - 1] == 0x01);
+
+  /* Redundant zero groups are accepted, up to the longest encoding */
+  unsigned char padded[] = { 0x85, 0x80, 0x00 };
+  w = (Wire){ padded, sizeof(padded), 0, FALSE };
+  CHECK(wire_get_varint(&w) == 5 && w.error == FALSE);
+
+  /* Longer than the longest encoding */
+  unsigned char too_long[WIRE_MAX_VARINT + 1];
+  memset(too_long, 0x80, sizeof(too_long));
+  too_long[WIRE_MAX_VARINT] = 0x01;
+  w = (Wire){ too_long, sizeof(too_long), 0, FALSE };
+  CHECK(wire_get_varint(&w) == 0 && w.error == TRUE);
+
+  /* Bits past the 64th in the last byte */
+  unsigned char overflow[WIRE_MAX_VARINT];
+  memset(overflow, 0xff, sizeof(overflow));
+  overflow[WIRE_MAX_VARINT - 1] = 0x02;
+  w = (Wire){ overflow, sizeof(overflow), 0, FALSE };
+  CHECK(wire_get_varint(&w) == 0 && w.error == TRUE);
+
+  /* The error is sticky */
+  w = (Wire){ buff, 0, 0, FALSE };
+  wire_get_varint(&w);
+  w.size = sizeof(buff);
+  CHECK(wire_get_varint(&w) == 0 && w.error == TRUE && w.pos == 0);
+}
+
+void test_fixed_width(void) {
+  unsigned char buff[8], data[4];
+  Wire w = { buff, sizeof(buff), 0, FALSE };
+
+  wire_put_u32(&w, 0x01020304);
+  wire_put_u32(&w, UINT32_MAX);
+  CHECK(w.error == FALSE && w.pos == 8);
+  CHECK(buff[0] == 1 && buff[1] == 2 && buff[2] == 3 && buff[3] == 4);
+  wire_put_u32(&w, 1);
+  CHECK(w.error == TRUE && w.pos == 8);
+
+  wire_set_u32(buff, 42);
+  w = (Wire){ buff, sizeof(buff), 0, FALSE };
+  CHECK(wire_get_u32(&w) == 42);
+  CHECK(wire_get_u32(&w) == UINT32_MAX);
+  CHECK(w.error == FALSE);
+  CHECK(wire_get_u32(&w) == 0 && w.error == TRUE);
+
+  w = (Wire){ buff, 3, 0, FALSE };
+  CHECK(wire_get_u32(&w) == 0 && w.error == TRUE && w.pos == 0);
+
+  w = (Wire){ buff, sizeof(buff), 0, FALSE };
+  wire_put_bytes(&w, "abcd", 4);
+  wire_put_bytes(&w, "efgh", 4);
+  CHECK(w.error == FALSE && memcmp(buff, "abcdefgh", 8) == 0);
+  wire_put_bytes(&w, "i", 1);
+  CHECK(w.error == TRUE);
+
+  w = (Wire){ buff, 6, 0, FALSE };
+  wire_get_bytes(&w, data, 4);
+  CHECK(w.error == FALSE && memcmp(data, "abcd", 4) == 0);
+  wire_get_bytes(&w, data, 4);
+  CHECK(w.error == TRUE && w.pos == 4);
+
+  w = (Wire){ buff, sizeof(buff), 0, FALSE };
+  wire_get_bytes(&w, data, -1);
+  CHECK(w.error == TRUE);
+}
+
+void test_header(void) {
+  unsigned char buff[16];
+  Wire w;
+
+  wire_begin(&w, buff, sizeof(buff), MSG);
+  wire_put_varint(&w, 300);
+  CHECK(wire_end(&w) == WIRE_HEADER_SIZE + 2);
+  CHECK(buff[0] == WIRE_VERSION && buff[1] == MSG);
+  CHECK(buff[2] == 0 && buff[3] == 2);
+  CHECK(wire_peek_type(buff, WIRE_HEADER_SIZE + 2) == MSG);
+
+  /* A packet can be extended and finished again */
+  wire_put_varint(&w, 1);
+  CHECK(wire_end(&w) == WIRE_HEADER_SIZE + 3 && buff[3] == 3);
+
+  /* Too short for the header, or for the length it gives */
+  for(int len=0; len<WIRE_HEADER_SIZE + 3; len++) {
+    char *copy = copy_packet(buff, len);
+    CHECK(wire_peek_type(copy, len) == FAILURE);
+    CHECK(wire_open(&w, copy, len) == FAILURE && w.error == TRUE);
+    CHECK(wire_get_varint(&w) == 0);
+    free(copy);
+  }
+
+  /* Another version */
+  buff[0] = WIRE_VERSION + 1;
+  CHECK(wire_peek_type(buff, WIRE_HEADER_SIZE + 3) == FAILURE);
+  buff[0] = WIRE_VERSION;
+
+  /* The cursor stops at the end of the body */
+  CHECK(wire_open(&w, buff, sizeof(buff)) == MSG);
+  CHECK(w.size == WIRE_HEADER_SIZE + 3);
+  CHECK(wire_get_int(&w) == 300 && wire_get_int(&w) == 1);
+  CHECK(w.error == FALSE);
+  CHECK(wire_get_int(&w) == 0 && w.error == TRUE);
+
+  /* No room for the header */
+  wire_begin(&w, buff, WIRE_HEADER_SIZE - 1, PING);
+  CHECK(wire_end(&w) == FAILURE);
+
+  /* Nor for a body longer than the length field */
+  unsigned char *big = malloc(WIRE_HEADER_SIZE + 0x10000);
+  if(big == NULL) {
+    perror("test_header: malloc");
+    exit(1);
+  }
+  wire_begin(&w, big, WIRE_HEADER_SIZE + 0x10000, PV);
+  for(int i=0; i<0xffff; i++)
+    wire_put_varint(&w, 0);
+  CHECK(wire_end(&w) == WIRE_HEADER_SIZE + 0xffff);
+  wire_put_varint(&w, 0);
+  CHECK(wire_end(&w) == FAILURE);
+  free(big);
+}
+
+void test_ping_packet(void) {
+  Ping_packet in = { 2001, 2002, 7, DEFAULT_HELLO_INTERVAL,
+                    DEFAULT_DETECT_MULTIPLIER }, out;
+  Encoded_packet packet;
+
+  packet.length = encode_ping_packet(&in, packet.data, sizeof(packet.data));
+  CHECK(packet.length > WIRE_HEADER_SIZE);
+  CHECK(wire_peek_type(packet.data, packet.length) == PING);
+
+  char *copy = copy_packet(packet.data, packet.length);
+  CHECK(decode_ping_packet(copy, packet.length, &out) == SUCCESS);
+  CHECK(out.sender_id == in.sender_id);
+  CHECK(out.sender_LS_port == in.sender_LS_port);
+  CHECK(out.sender_PV_port == in.sender_PV_port);
+  CHECK(out.interval == in.interval);
+  CHECK(out.detect_multiplier == in.detect_multiplier);
+  free(copy);
+
+  /* Nothing else decodes it */
+  CHECK(decode_copy(MSG, packet.data, packet.length) == FAILURE);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+  CHECK(decode_copy(DATA, packet.data, packet.length) == FAILURE);
+
+  /* Not enough room to encode it */
+  for(int size=0; size<packet.length; size++)
+    CHECK(encode_ping_packet(&in, packet.data, size) == FAILURE);
+}
+
+void test_msg_packet(void) {
+  Msg_packet in[] = { { 3, UNSET, 0 }, { 0, 0, 1 },
+                      { MAX_ROUTER_ID, MAX_ROUTER_ID, INT_MAX } }, out;
+  Encoded_packet packet;
+
+  for(int i=0; i<3; i++) {
+    packet.length = encode_msg_packet(&in[i], packet.data,
+                                      sizeof(packet.data));
+    CHECK(packet.length > WIRE_HEADER_SIZE);
+
+    char *copy = copy_packet(packet.data, packet.length);
+    CHECK(decode_msg_packet(copy, packet.length, &out) == SUCCESS);
+    CHECK(out.dest == in[i].dest);
+    CHECK(out.tunnel == in[i].tunnel);
+    CHECK(out.flow == in[i].flow);
+    free(copy);
+  }
+
+  /* The smallest message is one byte per field */
+  packet.length = encode_msg_packet(&in[1], packet.data, sizeof(packet.data));
+  CHECK(packet.length == WIRE_HEADER_SIZE + 3);
+
+  /* A tunnel to a router that can't exist */
+  Msg_packet bad = { 1, MAX_ROUTER_ID + 1, 0 };
+  packet.length = encode_msg_packet(&bad, packet.data, sizeof(packet.data));
+  CHECK(decode_copy(MSG, packet.data, packet.length) == FAILURE);
+}
+
+void test_pv_packet(void) {
+  Pv_packet *in = calloc(1, sizeof(Pv_packet));
+  Pv_packet *out = calloc(1, sizeof(Pv_packet));
+  Encoded_packet packet;
+
+  if(in == NULL || out == NULL) {
+    perror("test_pv_packet: calloc");
+    exit(1);
+  }
+
+  /* Every key length, including one with no terminator */
+  for(int key_length=0; key_length<=(int)sizeof(in->key); key_length++) {
+    memset(in->key, 0, sizeof(in->key));
+    memset(in->key, 'k', key_length);
+    in->sender_PV_port = 3001;
+    in->flags = PV_REFRESH;
+    in->num_withdrawn = key_length;
+    for(int i=0; i<in->num_withdrawn; i++)
+      in->withdrawn[i] = 100 + i;
+    in->num_routes = key_length;
+    for(int i=0; i<in->num_routes; i++) {
+      in->routes[i].dest = 200 + i;
+      in->routes[i].length = i + 1;
+      for(int k=0; k<=i; k++)
+        in->routes[i].path[k] = 300 + k;
+    }
+
+    packet.length = encode_pv_packet(in, packet.data, sizeof(packet.data));
+    CHECK(packet.length > WIRE_HEADER_SIZE);
+
+    char *copy = copy_packet(packet.data, packet.length);
+    memset(out, 0xff, sizeof(Pv_packet));
+    CHECK(decode_pv_packet(copy, packet.length, out) == SUCCESS);
+    CHECK(memcmp(out->key, in->key, sizeof(in->key)) == 0);
+    CHECK(out->sender_PV_port == in->sender_PV_port);
+    CHECK(out->flags == in->flags);
+    CHECK(out->num_withdrawn == in->num_withdrawn);
+    CHECK(memcmp(out->withdrawn, in->withdrawn,
+                 in->num_withdrawn * sizeof(int)) == 0);
+    CHECK(out->num_routes == in->num_routes);
+    for(int i=0; i<in->num_routes && i<out->num_routes; i++) {
+      CHECK(out->routes[i].dest == in->routes[i].dest);
+      CHECK(out->routes[i].length == in->routes[i].length);
+      CHECK(memcmp(out->routes[i].path, in->routes[i].path,
+                   in->routes[i].length * sizeof(int)) == 0);
+    }
+    free(copy);
+  }
+
+  /* The largest update fits in a receive buffer */
+  in->num_withdrawn = MAX_PV_WITHDRAWN;
+  for(int i=0; i<MAX_PV_WITHDRAWN; i++)
+    in->withdrawn[i] = MAX_ROUTER_ID - i;
+  in->num_routes = MAX_PV_ROUTES / 8;
+  for(int i=0; i<in->num_routes; i++) {
+    in->routes[i].dest = MAX_ROUTER_ID - i;
+    in->routes[i].length = MAX_PATH;
+    for(int k=0; k<MAX_PATH; k++)
+      in->routes[i].path[k] = k;
+  }
+  packet.length = encode_pv_packet(in, packet.data, sizeof(packet.data));
+  CHECK(packet.length > 0);
+  CHECK(decode_copy(PV, packet.data, packet.length) == SUCCESS);
+
+  free(in);
+  free(out);
+}
+
+void test_link_state_packet(void) {
+  Link_state_packet *in = calloc(1, sizeof(Link_state_packet));
+  Link_state_packet *out = calloc(1, sizeof(Link_state_packet));
+  Encoded_packet packet;
+  unsigned int sequences[] = { 0, 1, 128, INT_MAX, UINT_MAX };
+  int counts[] = { 0, 1, 2, MAX_LSA_NEIGHBORS };
+
+  if(in == NULL || out == NULL) {
+    perror("test_link_state_packet: calloc");
+    exit(1);
+  }
+
+  for(int s=0; s<5; s++) {
+    for(int c=0; c<4; c++) {
+      in->relayed_by = (c == 0) ? UNSET : c;
+      in->sender_id = MAX_ROUTER_ID - c;
+      in->sequence = sequences[s];
+      in->sender_LS_port = 4000 + s;
+      in->num_neighbors = counts[c];
+      for(int i=0; i<in->num_neighbors; i++) {
+        in->neighbors[i].id = i;
+        in->neighbors[i].cost = (i % 2 == 0) ? 1 : MAX_LINK_COST;
+      }
+
+      packet.length = encode_link_state_packet(in, packet.data,
+                                               sizeof(packet.data));
+      CHECK(packet.length > WIRE_HEADER_SIZE);
+
+      char *copy = copy_packet(packet.data, packet.length);
+      CHECK(decode_link_state_packet(copy, packet.length, out) == SUCCESS);
+      CHECK(out->relayed_by == in->relayed_by);
+      CHECK(out->sender_id == in->sender_id);
+      CHECK(out->sequence == in->sequence);
+      CHECK(out->sender_LS_port == in->sender_LS_port);
+      CHECK(out->num_neighbors == in->num_neighbors);
+      for(int i=0; i<in->num_neighbors && i<out->num_neighbors; i++) {
+        CHECK(out->neighbors[i].id == in->neighbors[i].id);
+        CHECK(out->neighbors[i].cost == in->neighbors[i].cost);
+      }
+      CHECK(out->buff == copy && out->cc == packet.length);
+
+      /* A relay rewrites relayed_by in place */
+      wire_set_u32(copy + WIRE_HEADER_SIZE, 9);
+      CHECK(decode_link_state_packet(copy, packet.length, out) == SUCCESS);
+      CHECK(out->relayed_by == 9 && out->sequence == in->sequence);
+      free(copy);
+    }
+  }
+
+  /* The largest advertisement, every field at its longest, fits */
+  in->relayed_by = MAX_ROUTER_ID;
+  in->sender_id = MAX_ROUTER_ID;
+  in->sequence = UINT_MAX;
+  in->sender_LS_port = 65535;
+  in->num_neighbors = MAX_LSA_NEIGHBORS;
+  for(int i=0; i<MAX_LSA_NEIGHBORS; i++) {
+    in->neighbors[i].id = MAX_ROUTER_ID - i;
+    in->neighbors[i].cost = MAX_LINK_COST;
+  }
+  packet.length = encode_link_state_packet(in, packet.data,
+                                           sizeof(packet.data));
+  CHECK(packet.length == LSA_OVERHEAD +
+                         MAX_LSA_NEIGHBORS * LSA_NEIGHBOR_SIZE);
+  CHECK(packet.length <= RECV_BUFFER_SIZE);
+  CHECK(decode_copy(DATA, packet.data, packet.length) == SUCCESS);
+
+  /* A sequence number that doesn't fit in 32 bits */
+  in->num_neighbors = 0;
+  Wire w;
+  wire_begin(&w, packet.data, sizeof(packet.data), DATA);
+  wire_put_u32(&w, 1);
+  wire_put_varint(&w, 1);
+  wire_put_varint(&w, (uint64_t)UINT_MAX + 1);
+  wire_put_varint(&w, 4000);
+  wire_put_varint(&w, 0);
+  packet.length = wire_end(&w);
+  CHECK(decode_copy(DATA, packet.data, packet.length) == FAILURE);
+
+  free(in);
+  free(out);
+}
+
+/*
+ * Packets and fields the decoders don't know about: the dispatcher skips
+ * packets of other types, and fields appended to a body by a later
+ * version of a packet are skipped by the length in the header.
+ */
+void test_unknown_fields(void) {
+  Ping_packet ping = { 2001, 2002, 7, 250, 3 }, ping_out;
+  Link_state_packet *lsa = calloc(1, sizeof(Link_state_packet));
+  Link_state_packet *lsa_out = calloc(1, sizeof(Link_state_packet));
+  Encoded_packet packet;
+  Wire w;
+
+  if(lsa == NULL || lsa_out == NULL) {
+    perror("test_unknown_fields: calloc");
+    exit(1);
+  }
+
+  /* A packet of a type nobody handles */
+  wire_begin(&w, packet.data, sizeof(packet.data), 200);
+  wire_put_varint(&w, 1);
+  packet.length = wire_end(&w);
+  CHECK(wire_peek_type(packet.data, packet.length) == 200);
+  CHECK(decode_copy(PING, packet.data, packet.length) == FAILURE);
+  CHECK(decode_copy(MSG, packet.data, packet.length) == FAILURE);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+  CHECK(decode_copy(DATA, packet.data, packet.length) == FAILURE);
+
+  /* Fields appended to the body, of every varint size */
+  packet.length = encode_ping_packet(&ping, packet.data, sizeof(packet.data));
+  int length = packet.length;
+  for(int i=0; i<4; i++) {
+    w = (Wire){ packet.data, sizeof(packet.data), packet.length, FALSE };
+    wire_put_varint(&w, (uint64_t)1 << (i * 21));
+    wire_put_bytes(&w, "ext", 3);
+    packet.length = wire_end(&w);
+
+    char *copy = copy_packet(packet.data, packet.length);
+    CHECK(decode_ping_packet(copy, packet.length, &ping_out) == SUCCESS);
+    CHECK(memcmp(&ping_out, &ping, sizeof(ping)) == 0);
+    free(copy);
+  }
+  CHECK(packet.length > length);
+
+  /* Bytes after the end of the body, in the same datagram */
+  lsa->relayed_by = 1;
+  lsa->sender_id = 2;
+  lsa->sequence = 3;
+  lsa->sender_LS_port = 4000;
+  lsa->num_neighbors = 1;
+  lsa->neighbors[0] = (Lsa_neighbor){ 5, 6 };
+  packet.length = encode_link_state_packet(lsa, packet.data,
+                                           sizeof(packet.data));
+  memset(packet.data + packet.length, 0xff, 16);
+  char *copy = copy_packet(packet.data, packet.length + 16);
+  CHECK(decode_link_state_packet(copy, packet.length + 16, lsa_out) ==
+        SUCCESS);
+  CHECK(lsa_out->num_neighbors == 1 && lsa_out->neighbors[0].cost == 6);
+  CHECK(lsa_out->cc == packet.length);
+  free(copy);
+
+  free(lsa);
+  free(lsa_out);
+}
+
+/*
+ * Every packet cut short, either by the datagram or by the length in its
+ * header, is rejected.
+ */
+void test_truncated(void) {
+  Ping_packet ping = { 2001, 2002, 7, 250, 3 };
+  Msg_packet msg = { 3, 4, 5 };
+  Pv_packet *pv = calloc(1, sizeof(Pv_packet));
+  Link_state_packet *lsa = calloc(1, sizeof(Link_state_packet));
+  Encoded_packet packets[4];
+  int types[] = { PING, MSG, PV, DATA };
+
+  if(pv == NULL || lsa == NULL) {
+    perror("test_truncated: calloc");
+    exit(1);
+  }
+
+  strcpy(pv->key, "secret");
+  pv->sender_PV_port = 3001;
+  pv->num_withdrawn = 2;
+  pv->withdrawn[0] = 300;
+  pv->withdrawn[1] = 301;
+  pv->num_routes = 2;
+  pv->routes[0] = (struct Path_vector){ 200, 2, { 1, 200 } };
+  pv->routes[1] = (struct Path_vector){ 201, 3, { 1, 2, 201 } };
+  lsa->relayed_by = 1;
+  lsa->sender_id = 2;
+  lsa->sequence = 1000;
+  lsa->sender_LS_port = 4000;
+  lsa->num_neighbors = 3;
+  for(int i=0; i<3; i++)
+    lsa->neighbors[i] = (Lsa_neighbor){ 10 + i, 200 + i };
+
+  packets[0].length = encode_ping_packet(&ping, packets[0].data,
+                                         RECV_BUFFER_SIZE);
+  packets[1].length = encode_msg_packet(&msg, packets[1].data,
+                                        RECV_BUFFER_SIZE);
+  packets[2].length = encode_pv_packet(pv, packets[2].data,
+                                       RECV_BUFFER_SIZE);
+  packets[3].length = encode_link_state_packet(lsa, packets[3].data,
+                                               RECV_BUFFER_SIZE);
+
+  for(int t=0; t<4; t++) {
+    Encoded_packet *packet = &packets[t];
+    int body_length = packet->length - WIRE_HEADER_SIZE;
+
+    CHECK(decode_copy(types[t], packet->data, packet->length) == SUCCESS);
+
+    /* The datagram ends before the body does */
+    for(int cc=0; cc<packet->length; cc++)
+      CHECK(decode_copy(types[t], packet->data, cc) == FAILURE);
+
+    /* The header says the body is shorter than it is */
+    for(int length=0; length<body_length; length++) {
+      set_body_length(packet->data, length);
+      CHECK(decode_copy(types[t], packet->data, packet->length) == FAILURE);
+    }
+
+    /* Or longer */
+    for(int length=body_length + 1; length<=0xffff; length += 997) {
+      set_body_length(packet->data, length);
+      CHECK(decode_copy(types[t], packet->data, packet->length) == FAILURE);
+    }
+    set_body_length(packet->data, body_length);
+  }
+
+  free(pv);
+  free(lsa);
+}
+
+/*
+ * Counts and lengths past what the packets can hold are rejected before
+ * anything is read into them.
+ */
+void test_limits(void) {
+  Encoded_packet packet;
+  Wire w;
+
+  /* A key longer than the field */
+  wire_begin(&w, packet.data, sizeof(packet.data), PV);
+  wire_put_varint(&w, 11);
+  wire_put_bytes(&w, "0123456789a", 11);
+  wire_put_varint(&w, 3001);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 0);
+  packet.length = wire_end(&w);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+
+  /* Too many withdrawals, announcing more than is sent */
+  wire_begin(&w, packet.data, sizeof(packet.data), PV);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 3001);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, MAX_PV_WITHDRAWN + 1);
+  wire_put_varint(&w, 1);
+  packet.length = wire_end(&w);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+
+  /* Too many withdrawals, all sent */
+  wire_begin(&w, packet.data, sizeof(packet.data), PV);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 3001);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, MAX_PV_WITHDRAWN + 1);
+  for(int i=0; i<=MAX_PV_WITHDRAWN; i++)
+    wire_put_varint(&w, i % 100);
+  wire_put_varint(&w, 0);
+  packet.length = wire_end(&w);
+  CHECK(packet.length > 0);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+
+  /* Too many routes */
+  wire_begin(&w, packet.data, sizeof(packet.data), PV);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 3001);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, MAX_PV_ROUTES + 1);
+  for(int i=0; i<=MAX_PV_ROUTES; i++) {
+    wire_put_varint(&w, i);
+    wire_put_varint(&w, 1);
+    wire_put_varint(&w, i);
+  }
+  packet.length = wire_end(&w);
+  CHECK(packet.length > 0);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+
+  /* A path longer than MAX_PATH */
+  wire_begin(&w, packet.data, sizeof(packet.data), PV);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 3001);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 1);
+  wire_put_varint(&w, 7);
+  wire_put_varint(&w, MAX_PATH + 1);
+  for(int k=0; k<=MAX_PATH; k++)
+    wire_put_varint(&w, k);
+  packet.length = wire_end(&w);
+  CHECK(packet.length > 0);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+
+  /* A route count that wraps an int */
+  wire_begin(&w, packet.data, sizeof(packet.data), PV);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 3001);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, 0);
+  wire_put_varint(&w, UINT64_MAX);
+  packet.length = wire_end(&w);
+  CHECK(decode_copy(PV, packet.data, packet.length) == FAILURE);
+
+  /* Too many neighbors, all sent */
+  wire_begin(&w, packet.data, sizeof(packet.data), DATA);
+  wire_put_u32(&w, 1);
+  wire_put_varint(&w, 2);
+  wire_put_varint(&w, 3);
+  wire_put_varint(&w, 4000);
+  wire_put_varint(&w, MAX_LSA_NEIGHBORS + 1);
+  for(int i=0; i<=MAX_LSA_NEIGHBORS; i++) {
+    wire_put_varint(&w, i % 100);
+    wire_put_varint(&w, 1);
+  }
+  packet.length = wire_end(&w);
+  CHECK(packet.length > 0);
+  CHECK(decode_copy(DATA, packet.data, packet.length) == FAILURE);
+
+  /* A field that doesn't fit in an int */
+  wire_begin(&w, packet.data, sizeof(packet.data), PING);
+  wire_put_varint(&w, (uint64_t)INT_MAX + 1);
+  for(int i=0; i<4; i++)
+    wire_put_varint(&w, 1);
+  packet.length = wire_end(&w);
+  CHECK(decode_copy(PING, packet.data, packet.length) == FAILURE);
+}
+
+int main(void) {
+  test_varints();
+  test_fixed_width();
+  test_header();
+  test_ping_packet();
+  test_msg_packet();
+  test_pv_packet();
+  test_link_state_packet();
+  test_unknown_fields();
+  test_truncated();
+  test_limits();
+
+  printf("%d checks, %d failed\n", num_checks, num_failures);
+  return (num_failures == 0) ? 0 : 1;
+}
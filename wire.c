@@ -0,0 +1,249 @@
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "wire.h"
+
+#define TRUE 1
+#define FALSE 0
+#define FAILURE -1
+
+/*
+ * void
+ * wire_begin
+ *
+ * Starts encoding a packet of type `type` into the `size` bytes at `buf`.
+ * The length in the header is filled in by wire_end().
+ */
+void wire_begin(Wire *w, void *buf, int size, int type) {
+  w->buf = buf;
+  w->size = size;
+  w->pos = 0;
+  w->error = (size < WIRE_HEADER_SIZE);
+  if(w->error == FALSE) {
+    w->buf[0] = WIRE_VERSION;
+    w->buf[1] = (unsigned char)type;
+    w->pos = WIRE_HEADER_SIZE;
+  }
+}
+
+/*
+ * int
+ * wire_end
+ *
+ * Finishes the packet started by wire_begin(), and returns its length, or
+ * FAILURE if it didn't fit. A packet can be extended and finished again,
+ * as long as nothing was written after its end in the meantime.
+ */
+int wire_end(Wire *w) {
+  int length = w->pos - WIRE_HEADER_SIZE;
+
+  if(w->error == TRUE || length > 0xffff)
+    return FAILURE;
+  w->buf[2] = (unsigned char)(length >> 8);
+  w->buf[3] = (unsigned char)length;
+  return w->pos;
+}
+
+/*
+ * int
+ * wire_peek_type
+ *
+ * Returns the type of the `len` byte packet at `buf`, or FAILURE if it
+ * isn't a complete packet of the current version.
+ */
+int wire_peek_type(const void *buf, int len) {
+  const unsigned char *bytes = buf;
+
+  if(len < WIRE_HEADER_SIZE || bytes[0] != WIRE_VERSION ||
+     ((bytes[2] << 8) | bytes[3]) > len - WIRE_HEADER_SIZE)
+    return FAILURE;
+  return bytes[1];
+}
+
+/*
+ * int
+ * wire_open
+ *
+ * Starts decoding the `len` byte packet at `buf`: checks its header, and
+ * returns its type, or FAILURE if it is not valid. The cursor is limited
+ * to the body, anything received after it is ignored.
+ */
+int wire_open(Wire *w, const void *buf, int len) {
+  int type = wire_peek_type(buf, len);
+
+  w->buf = (unsigned char *)buf;
+  w->pos = WIRE_HEADER_SIZE;
+  w->error = (type == FAILURE);
+  w->size = (type == FAILURE) ? 0 :
+            WIRE_HEADER_SIZE + ((w->buf[2] << 8) | w->buf[3]);
+  return type;
+}
+
+/*
+ * void
+ * wire_put_varint
+ *
+ * Appends `value` as a varint.
+ */
+void wire_put_varint(Wire *w, uint64_t value) {
+  unsigned char *p;
+
+  /* Check the room once, for the longest possible encoding */
+  if(w->error == TRUE || w->size - w->pos < WIRE_MAX_VARINT) {
+    if(w->error == TRUE || w->size - w->pos < wire_varint_size(value)) {
+      w->error = TRUE;
+      return;
+    }
+  }
+
+  p = w->buf + w->pos;
+  while(value >= 0x80) {
+    *p++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (unsigned char)value;
+  w->pos = p - w->buf;
+}
+
+/*
+ * int
+ * wire_varint_size
+ *
+ * Returns the number of bytes `value` takes as a varint.
+ */
+int wire_varint_size(uint64_t value) {
+  int size = 1;
+
+  while(value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+/*
+ * uint64_t
+ * wire_get_varint
+ *
+ * Reads a varint. Returns 0 and sets the error if there is none, or if it
+ * is too long, or too large, to be valid.
+ */
+uint64_t wire_get_varint(Wire *w) {
+  uint64_t value = 0;
+  int shift = 0;
+
+  while(w->error == FALSE) {
+    if(w->pos >= w->size || shift >= 64) {
+      w->error = TRUE;
+      break;
+    }
+    unsigned char byte = w->buf[w->pos++];
+    /* The last byte only has room for the 64th bit */
+    if(shift == 63 && byte > 1) {
+      w->error = TRUE;
+      break;
+    }
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if((byte & 0x80) == 0)
+      return value;
+    shift += 7;
+  }
+  return 0;
+}
+
+/*
+ * int
+ * wire_get_int
+ *
+ * Reads a varint that has to fit in a non-negative int. Returns 0 and sets
+ * the error otherwise.
+ */
+int wire_get_int(Wire *w) {
+  uint64_t value = wire_get_varint(w);
+
+  if(value > INT_MAX) {
+    w->error = TRUE;
+    return 0;
+  }
+  return (int)value;
+}
+
+/*
+ * void
+ * wire_put_u32
+ *
+ * Appends `value` as a fixed width, big-endian, 32-bit integer. Used for
+ * the fields that are rewritten in encoded packets (see wire_set_u32()).
+ */
+void wire_put_u32(Wire *w, uint32_t value) {
+  if(w->error == TRUE || w->size - w->pos < 4) {
+    w->error = TRUE;
+    return;
+  }
+  wire_set_u32(w->buf + w->pos, value);
+  w->pos += 4;
+}
+
+/*
+ * uint32_t
+ * wire_get_u32
+ *
+ * Reads a fixed width, big-endian, 32-bit integer.
+ */
+uint32_t wire_get_u32(Wire *w) {
+  const unsigned char *p;
+
+  if(w->error == TRUE || w->size - w->pos < 4) {
+    w->error = TRUE;
+    return 0;
+  }
+  p = w->buf + w->pos;
+  w->pos += 4;
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * void
+ * wire_set_u32
+ *
+ * Overwrites the fixed width integer at `buf`, in an encoded packet.
+ */
+void wire_set_u32(void *buf, uint32_t value) {
+  unsigned char *p = buf;
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char)value;
+}
+
+/*
+ * void
+ * wire_put_bytes
+ *
+ * Appends `len` raw bytes.
+ */
+void wire_put_bytes(Wire *w, const void *data, int len) {
+  if(w->error == TRUE || len < 0 || w->size - w->pos < len) {
+    w->error = TRUE;
+    return;
+  }
+  memcpy(w->buf + w->pos, data, len);
+  w->pos += len;
+}
+
+/*
+ * void
+ * wire_get_bytes
+ *
+ * Reads `len` raw bytes into `data`.
+ */
+void wire_get_bytes(Wire *w, void *data, int len) {
+  if(w->error == TRUE || len < 0 || w->size - w->pos < len) {
+    w->error = TRUE;
+    return;
+  }
+  memcpy(data, w->buf + w->pos, len);
+  w->pos += len;
+}
@@ -0,0 +1,48 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+
+/* Version of the wire format, carried in every packet */
+#define WIRE_VERSION 1
+
+/*
+ * Every packet starts with a header of WIRE_HEADER_SIZE bytes: the
+ * version, the packet type, and the length of the body that follows, as
+ * a big-endian 16-bit integer.
+ */
+#define WIRE_HEADER_SIZE 4
+
+/* Longest encoding of a varint */
+#define WIRE_MAX_VARINT 10
+
+/*
+ * Struct Wire, a cursor over a packet being encoded into, or decoded from,
+ * `size` bytes at `buf`. Integers are written as LEB128 varints (7 bits
+ * per byte, low bits first) unless a fixed width is asked for. Reading or
+ * writing past the end sets `error`, after which the cursor stops moving,
+ * so a whole packet can be handled before checking it once.
+ */
+struct Wire {
+  unsigned char *buf;
+  int size;
+  int pos;
+  int error;
+};
+typedef struct Wire Wire;
+
+int wire_end(Wire *w);
+int wire_get_int(Wire *w);
+int wire_open(Wire *w, const void *buf, int len);
+int wire_peek_type(const void *buf, int len);
+int wire_varint_size(uint64_t value);
+uint32_t wire_get_u32(Wire *w);
+uint64_t wire_get_varint(Wire *w);
+void wire_begin(Wire *w, void *buf, int size, int type);
+void wire_get_bytes(Wire *w, void *data, int len);
+void wire_put_bytes(Wire *w, const void *data, int len);
+void wire_put_u32(Wire *w, uint32_t value);
+void wire_put_varint(Wire *w, uint64_t value);
+void wire_set_u32(void *buf, uint32_t value);
+
+#endif